@@ -0,0 +1,350 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include "rangeserver.h"
+#include <fastdownloader.h>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QProcess>
+#include <QTemporaryDir>
+#include <QFile>
+#include <QHash>
+#include <QDir>
+
+#include <cstdio>
+#include <ctime>
+
+#if defined(Q_OS_UNIX)
+#  include <sys/resource.h>
+#endif
+
+static const qint64 VERIFY_BLOCK_SIZE = 1048576;
+static const int SERVER_START_TIMEOUT = 10000; // ms
+
+// In Kb, of the whole process, -1 if unknown
+static qint64 peakMemory()
+{
+#if defined(Q_OS_UNIX)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#  if defined(Q_OS_MACOS)
+    return usage.ru_maxrss / 1024;
+#  else
+    return usage.ru_maxrss;
+#  endif
+#else
+    return -1;
+#endif
+}
+
+static bool verify(QFile& file, qint64 offset, qint64 size)
+{
+    if (!file.seek(offset))
+        return false;
+
+    const qint64 end = offset + size;
+    while (offset < end) {
+        const QByteArray& data = file.read(qMin(VERIFY_BLOCK_SIZE, end - offset));
+        if (data.isEmpty())
+            return false;
+        for (int i = 0; i < data.size(); ++i) {
+            if (data.at(i) != contentAt(offset + i))
+                return false;
+        }
+        offset += data.size();
+    }
+    return true;
+}
+
+// Every other block of the content, empty for the whole content
+static QList<QPair<qint64, qint64>> scatteredRanges(qint64 size, qint64 rangeSize)
+{
+    QList<QPair<qint64, qint64>> ranges;
+    for (qint64 head = 0; rangeSize > 0 && head < size; head += 2 * rangeSize)
+        ranges.append({head, qMin(rangeSize, size - head)});
+    return ranges;
+}
+
+static bool verify(const QString& fileName, qint64 size, const QList<QPair<qint64, qint64>>& ranges)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    if (ranges.isEmpty())
+        return file.size() == size && verify(file, 0, size);
+
+    for (const auto& range : ranges) {
+        if (!verify(file, range.first, range.second))
+            return false;
+    }
+    return true;
+}
+
+static QList<qint64> numberList(const QString& value)
+{
+    QList<qint64> numbers;
+    for (const QString& number : value.split(',')) {
+        if (!number.trimmed().isEmpty())
+            numbers.append(number.trimmed().toLongLong());
+    }
+    return numbers;
+}
+
+static RangeServerOptions serverOptions(const QCommandLineParser& parser)
+{
+    RangeServerOptions options;
+    options.contentSize = parser.value("size").toLongLong();
+    options.bandwidth = parser.value("bandwidth").toLongLong();
+    options.latency = parser.value("latency").toInt();
+    options.jitter = parser.value("jitter").toInt();
+    options.stallRate = parser.value("stall-rate").toDouble();
+    options.stallDuration = parser.value("stall-duration").toInt();
+    options.errorRate = parser.value("error-rate").toDouble();
+    options.ranges = !parser.isSet("no-ranges");
+
+    if (parser.isSet("cert")) {
+        QFile cert(parser.value("cert"));
+        QFile key(parser.value("key"));
+        if (cert.open(QIODevice::ReadOnly) && key.open(QIODevice::ReadOnly)) {
+            options.certificate = QSslCertificate(cert.readAll(), QSsl::Pem);
+            options.privateKey = QSslKey(key.readAll(), QSsl::Rsa, QSsl::Pem);
+        }
+        if (options.certificate.isNull() || options.privateKey.isNull())
+            qWarning("Cannot load the certificate or the private key, serving plain HTTP");
+    }
+
+    return options;
+}
+
+static int serve(const QCommandLineParser& parser)
+{
+    RangeServer server(serverOptions(parser));
+    if (!server.listen(QHostAddress::LocalHost, quint16(parser.value("port").toUInt()))) {
+        qWarning("Cannot listen, %s", qPrintable(server.errorString()));
+        return EXIT_FAILURE;
+    }
+
+    std::printf("listening %d\n", server.serverPort());
+    std::fflush(stdout);
+    return QCoreApplication::exec();
+}
+
+// A single download, measured in a process of its own so the peak memory is its own too
+static int run(const QCommandLineParser& parser)
+{
+    const QUrl url(parser.value("run"));
+    const QString& output = parser.value("output");
+    const qint64 size = parser.value("size").toLongLong();
+
+    FastDownloader downloader(url, int(numberList(parser.value("connections")).value(0)));
+    downloader.setChunkSizeLimit(numberList(parser.value("chunk-sizes")).value(0));
+    downloader.setWorkerThreadCount(int(numberList(parser.value("workers")).value(0)));
+    downloader.setOutputFile(output);
+    downloader.setMaxRetries(10);
+    downloader.setRetryDelay(100);
+    downloader.setRanges(scatteredRanges(size, parser.value("range-size").toLongLong()));
+    downloader.setMultipartRequestsEnabled(parser.isSet("multipart"));
+    downloader.setMaxHedgedBytes(parser.value("hedge").toLongLong());
+    downloader.setStallTimeout(parser.value("stall-timeout").toInt());
+    if (url.scheme() == "https") {
+        QSslConfiguration config = downloader.sslConfiguration();
+        config.setPeerVerifyMode(QSslSocket::VerifyNone);
+        downloader.setSslConfiguration(config);
+    }
+
+    QEventLoop loop;
+    QObject::connect(&downloader, SIGNAL(finished()), &loop, SLOT(quit()));
+
+    // Note that std::clock is the wall time on Windows, the CPU time of the process elsewhere
+    const std::clock_t cpuStart = std::clock();
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!downloader.start())
+        return EXIT_FAILURE;
+    loop.exec();
+
+    const qint64 wall = timer.elapsed();
+    const qreal cpu = (std::clock() - cpuStart) * 1000.0 / CLOCKS_PER_SEC;
+    const FastDownloader::Statistics& statistics = downloader.statistics();
+    const bool ok = !downloader.isError() && verify(output, size, downloader.ranges());
+    QFile::remove(output);
+
+    std::printf("result wall=%lld bytes=%lld cpu=%.1f rss=%lld requests=%d retries=%d ok=%d\n",
+                wall, statistics.bytesReceived, cpu, peakMemory(),
+                statistics.requestCount, statistics.retryCount, ok);
+    std::fflush(stdout);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static QStringList forwardedArguments(const QCommandLineParser& parser, const QStringList& names)
+{
+    QStringList arguments;
+    for (const QString& name : names) {
+        if (parser.isSet(name))
+            arguments << "--" + name << parser.value(name);
+    }
+    return arguments;
+}
+
+// Starts a server, then runs a download for each combination, each in a new process
+static int suite(const QCommandLineParser& parser)
+{
+    const QString& program = QCoreApplication::applicationFilePath();
+    const QStringList serverArguments = QStringList("--serve")
+            + forwardedArguments(parser, {"size", "bandwidth", "latency", "jitter", "stall-rate",
+                                          "stall-duration", "error-rate", "cert", "key"})
+            + (parser.isSet("no-ranges") ? QStringList("--no-ranges") : QStringList());
+
+    QProcess server;
+    server.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    server.start(program, serverArguments);
+    if (!server.waitForReadyRead(SERVER_START_TIMEOUT)) {
+        qWarning("Cannot start the server");
+        return EXIT_FAILURE;
+    }
+
+    const QByteArray& line = server.readLine().trimmed();
+    if (!line.startsWith("listening ")) {
+        qWarning("Cannot start the server");
+        server.kill();
+        return EXIT_FAILURE;
+    }
+
+    QUrl url;
+    url.setScheme(parser.isSet("cert") ? "https" : "http");
+    url.setHost("127.0.0.1");
+    url.setPort(line.mid(10).toInt());
+    url.setPath("/content.bin");
+
+    QTemporaryDir temporaryDir;
+    const QString& outputDir = parser.isSet("output") ? parser.value("output") : temporaryDir.path();
+    const qint64 size = parser.value("size").toLongLong();
+
+    qint64 requestedSize = 0;
+    const QList<QPair<qint64, qint64>>& ranges = scatteredRanges(size, parser.value("range-size").toLongLong());
+    for (const auto& range : ranges)
+        requestedSize += range.second;
+    if (ranges.isEmpty())
+        requestedSize = size;
+
+    std::printf("%-12s %-10s %-8s %-10s %-10s %-12s %-12s %-9s %-8s %s\n",
+                "connections", "chunk", "workers", "wall(ms)", "MB/s", "cpu(ms/MB)",
+                "peak(MB)", "requests", "retries", "ok");
+
+    bool failed = false;
+    for (qint64 connections : numberList(parser.value("connections"))) {
+        for (qint64 chunkSize : numberList(parser.value("chunk-sizes"))) {
+            for (qint64 workers : numberList(parser.value("workers"))) {
+                for (int i = 0; i < parser.value("repeat").toInt(); ++i) {
+                    const QStringList arguments = QStringList()
+                            << "--run" << url.toString()
+                            << "--output" << QDir(outputDir).filePath("content.bin")
+                            << "--size" << QString::number(size)
+                            << "--connections" << QString::number(connections)
+                            << "--chunk-sizes" << QString::number(chunkSize)
+                            << "--workers" << QString::number(workers)
+                            << forwardedArguments(parser, {"range-size", "hedge", "stall-timeout"})
+                            << (parser.isSet("multipart") ? QStringList("--multipart") : QStringList());
+
+                    QProcess process;
+                    process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+                    process.start(program, arguments);
+                    process.waitForFinished(-1);
+
+                    QByteArray result;
+                    for (const QByteArray& output : process.readAllStandardOutput().split('\n')) {
+                        if (output.startsWith("result "))
+                            result = output;
+                    }
+
+                    QHash<QByteArray, QByteArray> values;
+                    for (const QByteArray& pair : result.mid(7).split(' '))
+                        values.insert(pair.left(pair.indexOf('=')), pair.mid(pair.indexOf('=') + 1));
+
+                    const qint64 wall = values.value("wall").toLongLong();
+                    const qreal megabytes = requestedSize / 1048576.0;
+                    const bool ok = values.value("ok") == "1";
+                    failed |= !ok;
+
+                    std::printf("%-12lld %-10lld %-8lld %-10lld %-10.2f %-12.2f %-12.1f %-9d %-8d %s\n",
+                                connections, chunkSize, workers, wall,
+                                wall > 0 ? megabytes * 1000 / wall : 0.0,
+                                megabytes > 0 ? values.value("cpu").toDouble() / megabytes : 0.0,
+                                values.value("rss").toLongLong() / 1024.0,
+                                values.value("requests").toInt(), values.value("retries").toInt(),
+                                ok ? "yes" : "NO");
+                    std::fflush(stdout);
+                }
+            }
+        }
+    }
+
+    server.kill();
+    server.waitForFinished();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures FastDownloader against a local range-capable server");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"serve", "Only runs the server, prints the port it listens on."},
+        {"port", "Port of the server, any free one if zero.", "port", "0"},
+        {"run", "Only runs a single download from the url given, prints the results.", "url"},
+        {"output", "Directory (or file, with --run) the downloads are written into.", "path"},
+        {"size", "Content size, in bytes.", "bytes", "67108864"},
+        {"bandwidth", "Bandwidth of each connection, in bytes per second (0: no limit).", "bytes", "0"},
+        {"latency", "Latency before each response, in ms.", "ms", "0"},
+        {"jitter", "Random extra latency, in ms.", "ms", "0"},
+        {"stall-rate", "Chance of a response stalling once.", "rate", "0"},
+        {"stall-duration", "Duration of stalls, in ms.", "ms", "2000"},
+        {"error-rate", "Chance of a response failing (503 or cut off).", "rate", "0"},
+        {"no-ranges", "The server ignores range requests."},
+        {"cert", "PEM certificate, serves HTTPS along with --key.", "file"},
+        {"key", "PEM private key (RSA) of the certificate.", "file"},
+        {"connections", "Numbers of simultaneous connections to measure (0: auto).", "list", "1,2,4,8,16"},
+        {"chunk-sizes", "Chunk size limits to measure (0: none, -1: auto).", "list", "0,-1,1048576"},
+        {"workers", "Numbers of worker threads to measure.", "list", "0"},
+        {"range-size", "Downloads every other block of that size only (0: the whole content).", "bytes", "0"},
+        {"multipart", "Packs small ranges into multipart requests (needs --range-size of 65536 or less)."},
+        {"hedge", "Bytes to request again from the slowest connections at the end.", "bytes", "0"},
+        {"stall-timeout", "Replaces connections receiving nothing for that long (0: never).", "ms", "0"},
+        {"repeat", "Runs of each combination.", "count", "1"}
+    });
+    parser.process(app);
+
+    if (parser.isSet("serve"))
+        return serve(parser);
+    if (parser.isSet("run"))
+        return run(parser);
+    return suite(parser);
+}
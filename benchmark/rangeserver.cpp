@@ -0,0 +1,343 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include "rangeserver.h"
+
+#include <QSslSocket>
+#include <QTimer>
+#include <QRandomGenerator>
+
+static const qint64 PUMP_BLOCK = 65536; // Bytes generated and written at once
+static const qint64 MAX_PENDING = 262144; // Bytes waiting in the socket before we stop writing
+static const int PUMP_INTERVAL = 10; // ms, how often a bandwidth limited response is written
+static const int MAX_HEAD_SIZE = 65536;
+static const char BOUNDARY[] = "RANGESERVER_BOUNDARY";
+
+RangeServer::RangeServer(const RangeServerOptions& options, QObject* parent) : QTcpServer(parent)
+  , m_options(options)
+{
+}
+
+const RangeServerOptions& RangeServer::options() const
+{
+    return m_options;
+}
+
+void RangeServer::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket* socket;
+    if (m_options.certificate.isNull()) {
+        socket = new QTcpSocket(this);
+        socket->setSocketDescriptor(socketDescriptor);
+    } else {
+        auto sslSocket = new QSslSocket(this);
+        sslSocket->setSocketDescriptor(socketDescriptor);
+        sslSocket->setLocalCertificate(m_options.certificate);
+        sslSocket->setPrivateKey(m_options.privateKey);
+        sslSocket->startServerEncryption();
+        socket = sslSocket;
+    }
+
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    new RangeSession(socket, m_options);
+}
+
+RangeSession::RangeSession(QTcpSocket* socket, const RangeServerOptions& options) : QObject(socket)
+  , m_socket(socket)
+  , m_options(options)
+  , m_timer(new QTimer(this))
+  , m_busy(false)
+  , m_sent(0)
+  , m_bodySize(0)
+  , m_stallAt(-1)
+  , m_dropAt(-1)
+  , m_budget(0)
+  , m_lastPump(0)
+  , m_resumeTime(0)
+{
+    m_clock.start();
+    m_timer->setSingleShot(true);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(pump()));
+    connect(m_socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+    connect(m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(onBytesWritten()));
+}
+
+void RangeSession::onReadyRead()
+{
+    m_buffer.append(m_socket->readAll());
+    if (m_busy)
+        return;
+
+    const int end = m_buffer.indexOf("\r\n\r\n");
+    if (end < 0) {
+        if (m_buffer.size() > MAX_HEAD_SIZE)
+            m_socket->abort();
+        return;
+    }
+
+    const QByteArray head = m_buffer.left(end);
+    m_buffer.remove(0, end + 4);
+    respond(head);
+}
+
+void RangeSession::onBytesWritten()
+{
+    if (!m_timer->isActive())
+        pump();
+}
+
+void RangeSession::startResponse()
+{
+    m_socket->write(m_head);
+    m_head.clear();
+    m_lastPump = m_clock.elapsed();
+    m_budget = 0;
+    pump();
+}
+
+void RangeSession::pump()
+{
+    if (!m_busy || !m_head.isEmpty())
+        return;
+
+    const qint64 now = m_clock.elapsed();
+    if (now < m_resumeTime) {
+        m_timer->start(int(m_resumeTime - now));
+        return;
+    }
+
+    if (m_options.bandwidth > 0) {
+        const qint64 burst = qMax(m_options.bandwidth / 10, PUMP_BLOCK);
+        m_budget = qMin(m_budget + (now - m_lastPump) * m_options.bandwidth / 1000, burst);
+        m_lastPump = now;
+    }
+
+    while (!m_segments.isEmpty() && m_socket->bytesToWrite() < MAX_PENDING) {
+        if (m_stallAt >= 0 && m_sent >= m_stallAt) {
+            m_stallAt = -1;
+            m_resumeTime = now + m_options.stallDuration;
+            m_timer->start(m_options.stallDuration);
+            return;
+        }
+
+        if (m_dropAt >= 0 && m_sent >= m_dropAt) {
+            m_socket->abort();
+            return;
+        }
+
+        qint64 block = PUMP_BLOCK;
+        if (m_options.bandwidth > 0) {
+            if (m_budget <= 0)
+                break;
+            block = qMin(block, m_budget);
+        }
+        if (m_stallAt >= 0)
+            block = qMin(block, m_stallAt - m_sent);
+        if (m_dropAt >= 0)
+            block = qMin(block, m_dropAt - m_sent);
+
+        QByteArray data;
+        Segment& segment = m_segments.first();
+        if (!segment.literal.isEmpty()) {
+            data = segment.literal;
+            m_segments.removeFirst();
+        } else {
+            const qint64 size = qMin(block, segment.size);
+            data.resize(int(size));
+            for (qint64 i = 0; i < size; ++i)
+                data[int(i)] = contentAt(segment.offset + i);
+            segment.offset += size;
+            segment.size -= size;
+            if (segment.size <= 0)
+                m_segments.removeFirst();
+        }
+
+        m_socket->write(data);
+        m_sent += data.size();
+        m_budget -= data.size();
+    }
+
+    if (m_segments.isEmpty()) {
+        finishResponse();
+        return;
+    }
+
+    // Otherwise the next "bytesWritten" signal carries on
+    if (m_options.bandwidth > 0 && m_budget <= 0)
+        m_timer->start(PUMP_INTERVAL);
+}
+
+void RangeSession::respond(const QByteArray& head)
+{
+    const QList<QByteArray>& lines = head.split('\n');
+    const QList<QByteArray>& requestLine = lines.first().trimmed().split(' ');
+    const QByteArray& method = requestLine.first();
+
+    QByteArray range;
+    for (int i = 1; i < lines.size(); ++i) {
+        const QByteArray& line = lines.at(i).trimmed();
+        if (line.toLower().startsWith("range:"))
+            range = line.mid(6).trimmed();
+    }
+
+    m_busy = true;
+    m_sent = 0;
+    m_bodySize = 0;
+    m_stallAt = -1;
+    m_dropAt = -1;
+    m_segments.clear();
+
+    QRandomGenerator* random = QRandomGenerator::global();
+    const qint64 size = m_options.contentSize;
+    const QByteArray& total = QByteArray::number(size);
+
+    QList<QByteArray> headers;
+    headers.append("ETag: \"rangeserver\"");
+    headers.append("Last-Modified: Mon, 01 Jul 2019 00:00:00 GMT");
+    if (m_options.ranges)
+        headers.append("Accept-Ranges: bytes");
+
+    int status = 200;
+    QByteArray reason = "OK";
+    QList<QPair<qint64, qint64>> ranges;
+
+    if (method != "GET" && method != "HEAD") {
+        status = 405;
+        reason = "Method Not Allowed";
+    } else if (method == "GET" && random->generateDouble() < m_options.errorRate / 2) {
+        status = 503;
+        reason = "Service Unavailable";
+    } else if (!m_options.ranges || range.isEmpty()) {
+        Segment segment;
+        segment.size = size;
+        m_segments.append(segment);
+        headers.append("Content-Type: application/octet-stream");
+    } else if (!parseRanges(range, &ranges)) {
+        status = 416;
+        reason = "Range Not Satisfiable";
+        headers.append("Content-Range: bytes */" + total);
+    } else if (ranges.size() == 1) {
+        status = 206;
+        reason = "Partial Content";
+        Segment segment;
+        segment.offset = ranges.first().first;
+        segment.size = ranges.first().second - ranges.first().first + 1;
+        m_segments.append(segment);
+        headers.append("Content-Type: application/octet-stream");
+        headers.append("Content-Range: bytes " + QByteArray::number(ranges.first().first) + '-'
+                       + QByteArray::number(ranges.first().second) + '/' + total);
+    } else {
+        status = 206;
+        reason = "Partial Content";
+        for (int i = 0; i < ranges.size(); ++i) {
+            Segment part;
+            part.literal = QByteArray(i > 0 ? "\r\n" : "") + "--" + BOUNDARY + "\r\n"
+                    + "Content-Type: application/octet-stream\r\n"
+                    + "Content-Range: bytes " + QByteArray::number(ranges.at(i).first) + '-'
+                    + QByteArray::number(ranges.at(i).second) + '/' + total + "\r\n\r\n";
+            m_segments.append(part);
+            Segment segment;
+            segment.offset = ranges.at(i).first;
+            segment.size = ranges.at(i).second - ranges.at(i).first + 1;
+            m_segments.append(segment);
+        }
+        Segment closing;
+        closing.literal = QByteArray("\r\n--") + BOUNDARY + "--\r\n";
+        m_segments.append(closing);
+        headers.append(QByteArray("Content-Type: multipart/byteranges; boundary=") + BOUNDARY);
+    }
+
+    for (const Segment& segment : m_segments)
+        m_bodySize += segment.literal.isEmpty() ? segment.size : segment.literal.size();
+
+    // A HEAD request gets the headers of the whole content
+    if (method == "HEAD") {
+        headers.append("Content-Length: " + total);
+        m_segments.clear();
+    } else {
+        headers.append("Content-Length: " + QByteArray::number(m_bodySize));
+    }
+
+    if (m_bodySize > 0 && !m_segments.isEmpty()) {
+        if (random->generateDouble() < m_options.stallRate)
+            m_stallAt = qint64(random->generateDouble() * m_bodySize);
+        if (random->generateDouble() < m_options.errorRate / 2)
+            m_dropAt = qint64(random->generateDouble() * m_bodySize);
+    }
+
+    m_head = "HTTP/1.1 " + QByteArray::number(status) + ' ' + reason + "\r\n";
+    for (const QByteArray& header : headers)
+        m_head += header + "\r\n";
+    m_head += "\r\n";
+
+    const int delay = m_options.latency + (m_options.jitter > 0 ? random->bounded(m_options.jitter + 1) : 0);
+    if (delay > 0)
+        QTimer::singleShot(delay, this, SLOT(startResponse()));
+    else
+        startResponse();
+}
+
+bool RangeSession::parseRanges(const QByteArray& value, QList<QPair<qint64, qint64>>* ranges) const
+{
+    // i.e. "bytes=0-99,200-,-300"
+    if (!value.startsWith("bytes="))
+        return false;
+
+    const qint64 size = m_options.contentSize;
+    for (const QByteArray& spec : value.mid(6).split(',')) {
+        const QByteArray& trimmed = spec.trimmed();
+        const int dash = trimmed.indexOf('-');
+        if (dash < 0)
+            return false;
+
+        bool ok1 = true, ok2 = true;
+        const QByteArray& first = trimmed.left(dash);
+        const QByteArray& last = trimmed.mid(dash + 1);
+        qint64 begin, end;
+        if (first.isEmpty()) {
+            const qint64 suffix = last.toLongLong(&ok2);
+            begin = qMax(qint64(0), size - suffix);
+            end = size - 1;
+        } else {
+            begin = first.toLongLong(&ok1);
+            end = last.isEmpty() ? size - 1 : qMin(size - 1, last.toLongLong(&ok2));
+        }
+
+        if (!ok1 || !ok2 || begin < 0 || begin > end || begin >= size)
+            return false;
+        ranges->append(qMakePair(begin, end));
+    }
+
+    return !ranges->isEmpty();
+}
+
+void RangeSession::finishResponse()
+{
+    m_busy = false;
+
+    // The next request may have arrived already
+    if (!m_buffer.isEmpty())
+        QTimer::singleShot(0, this, SLOT(onReadyRead()));
+}
+
+#include "moc_rangeserver.cpp"
@@ -0,0 +1,117 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef RANGESERVER_H
+#define RANGESERVER_H
+
+#include <QTcpServer>
+#include <QElapsedTimer>
+#include <QSslCertificate>
+#include <QSslKey>
+
+class QTcpSocket;
+class QTimer;
+
+struct RangeServerOptions
+{
+    qint64 contentSize = 67108864;
+    qint64 bandwidth = 0; // Per connection, bytes per second, zero means no limit
+    int latency = 0; // ms, before each response
+    int jitter = 0; // ms, random extra latency on top
+    qreal stallRate = 0; // Chance of a response pausing once somewhere in its body
+    int stallDuration = 2000; // ms
+    qreal errorRate = 0; // Chance of a response failing, half with 503 and half cut off midway
+    bool ranges = true; // Range requests (single and multipart) are served
+    QSslCertificate certificate; // Serves HTTPS if set, along with the key
+    QSslKey privateKey;
+};
+
+// The content is generated out of the offset, so nothing is kept in memory and the output can be verified
+inline char contentAt(qint64 offset)
+{
+    return char((offset * 7 + (offset >> 12)) & 0xff);
+}
+
+// A stand-in HTTP(S) server serving a single resource, with the flaws set in the options
+class RangeServer : public QTcpServer
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(RangeServer)
+
+public:
+    explicit RangeServer(const RangeServerOptions& options, QObject* parent = nullptr);
+
+    const RangeServerOptions& options() const;
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+
+private:
+    const RangeServerOptions m_options;
+};
+
+// Serves the requests on a single (keep-alive) connection, one at a time
+class RangeSession : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(RangeSession)
+
+    struct Segment
+    {
+        QByteArray literal; // Multipart delimiters and headers, otherwise the content is sent
+        qint64 offset = 0;
+        qint64 size = 0;
+    };
+
+public:
+    explicit RangeSession(QTcpSocket* socket, const RangeServerOptions& options);
+
+private slots:
+    void onReadyRead();
+    void onBytesWritten();
+    void startResponse();
+    void pump();
+
+private:
+    void respond(const QByteArray& head);
+    bool parseRanges(const QByteArray& value, QList<QPair<qint64, qint64>>* ranges) const;
+    void finishResponse();
+
+private:
+    QTcpSocket* m_socket;
+    const RangeServerOptions& m_options;
+    QTimer* m_timer;
+    QElapsedTimer m_clock;
+    QByteArray m_buffer;
+    QByteArray m_head; // Of the response, until it is sent after the latency
+    bool m_busy;
+    QList<Segment> m_segments;
+    qint64 m_sent; // Of the body
+    qint64 m_bodySize;
+    qint64 m_stallAt; // Of the body, -1 if there is none
+    qint64 m_dropAt;
+    qint64 m_budget; // Bytes allowed to be sent, see bandwidth
+    qint64 m_lastPump;
+    qint64 m_resumeTime;
+};
+
+#endif // RANGESERVER_H
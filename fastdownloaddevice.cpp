@@ -0,0 +1,411 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include "fastdownloaddevice_p.h"
+#include "fastdownloader_p.h"
+
+#include <QEventLoop>
+#include <QTimer>
+
+static const qint64 HELD_READ_BUFFER_DIVISOR = 8; // Unbounded reply buffers get that fraction of maxBufferSize
+
+FastDownloadDevicePrivate::FastDownloadDevicePrivate() : QIODevicePrivate()
+  , downloadFinished(false)
+  , readyEnd(0)
+  , readyBytes(0)
+  , pendingBytes(0)
+  , readBufferSizeChanged(false)
+  , previousReadBufferSize(0)
+{
+}
+
+void FastDownloadDevicePrivate::clear()
+{
+    downloadFinished = false;
+    readyEnd = 0;
+    readyBytes = 0;
+    ready.clear();
+    pendingBytes = 0;
+    pending.clear();
+    held.clear();
+}
+
+qint64 FastDownloadDevicePrivate::pull(int id, bool force)
+{
+    Q_Q(const FastDownloadDevice);
+
+    qint64 taken = 0;
+    forever {
+        const qint64 available = downloader->bytesAvailable(id);
+        if (available <= 0) {
+            held.remove(id);
+            break;
+        }
+
+        const qint64 offset = downloader->head(id) + downloader->pos(id);
+        if (offset < readyEnd) {
+            // Delivered by another connection already
+            taken += downloader->skip(id, qMin(available, readyEnd - offset));
+            continue;
+        }
+
+        const bool inOrder = offset == readyEnd;
+        const qint64 room = force
+                ? available
+                : qMin(available, q->maxBufferSize() - (inOrder ? readyBytes : pendingBytes));
+        if (room <= 0) {
+            held.insert(id);
+            break;
+        }
+
+        const QByteArray& data = downloader->read(id, room);
+        if (data.isEmpty())
+            break;
+        taken += data.size();
+
+        if (inOrder) {
+            ready.append(data);
+            readyBytes += data.size();
+            readyEnd += data.size();
+            takePending();
+        } else {
+            pending.insert(offset, data);
+            pendingBytes += data.size();
+        }
+    }
+
+    return taken;
+}
+
+bool FastDownloadDevicePrivate::pullHeld()
+{
+    const qint64 readyBefore = readyBytes;
+
+    // Connections may go away without a "finished" signal (i.e. requeued ones)
+    const FastDownloaderPrivate* downloaderPrivate = FastDownloaderPrivate::get(downloader);
+    for (int id : held.values()) {
+        if (!downloaderPrivate->connectionExists(id))
+            held.remove(id);
+    }
+
+    // Whatever one of them delivers may make room for the others
+    qint64 taken;
+    do {
+        taken = 0;
+        for (int id : held.values())
+            taken += pull(id, false);
+    } while (taken > 0 && !held.isEmpty());
+
+    return readyBytes > readyBefore;
+}
+
+void FastDownloadDevicePrivate::takePending()
+{
+    while (!pending.isEmpty() && pending.firstKey() <= readyEnd) {
+        const qint64 offset = pending.firstKey();
+        const QByteArray& data = pending.take(offset);
+        pendingBytes -= data.size();
+
+        const qint64 end = offset + data.size();
+        if (end <= readyEnd)
+            continue;
+
+        const QByteArray& part = offset == readyEnd ? data : data.mid(int(readyEnd - offset));
+        ready.append(part);
+        readyBytes += part.size();
+        readyEnd = end;
+    }
+}
+
+void FastDownloadDevicePrivate::updateHint() const
+{
+    Q_Q(const FastDownloadDevice);
+    // Anchored at where the reading is, what is ready but not read yet is in the window too
+    if (downloader)
+        FastDownloaderPrivate::get(downloader)->setSequentialHint(readyEnd - readyBytes, q->maxBufferSize());
+}
+
+void FastDownloadDevicePrivate::restoreReadBufferSize()
+{
+    if (readBufferSizeChanged && downloader)
+        downloader->setReadBufferSize(previousReadBufferSize);
+    readBufferSizeChanged = false;
+}
+
+void FastDownloadDevicePrivate::_q_readyRead(int id)
+{
+    Q_Q(FastDownloadDevice);
+
+    if (!q->isOpen())
+        return;
+
+    const qint64 readyBefore = readyBytes;
+    pull(id, false);
+    pullHeld();
+
+    if (readyBytes > readyBefore) {
+        updateHint();
+        emit q->readyRead();
+    }
+}
+
+void FastDownloadDevicePrivate::_q_finished(int id)
+{
+    Q_Q(FastDownloadDevice);
+
+    // Connections of an aborted download are gone already
+    if (!q->isOpen() || !downloader->isRunning())
+        return;
+
+    // The connection goes away soon, so everything it has is taken regardless of the limits
+    const qint64 readyBefore = readyBytes;
+    pull(id, true);
+    pullHeld();
+
+    if (readyBytes > readyBefore) {
+        updateHint();
+        emit q->readyRead();
+    }
+}
+
+void FastDownloadDevicePrivate::_q_finished()
+{
+    Q_Q(FastDownloadDevice);
+
+    if (!q->isOpen())
+        return;
+
+    downloadFinished = true;
+    if (downloader->isError())
+        q->setErrorString(QStringLiteral("Download failed"));
+
+    emit q->readChannelFinished();
+}
+
+FastDownloadDevice::FastDownloadDevice(FastDownloader* downloader, QObject* parent)
+    : FastDownloadDevice(*(new FastDownloadDevicePrivate), downloader, parent)
+{
+}
+
+FastDownloadDevice::FastDownloadDevice(FastDownloadDevicePrivate& dd, FastDownloader* downloader, QObject* parent)
+    : QIODevice(dd, parent)
+    , m_maxBufferSize(DEFAULT_MAX_BUFFER_SIZE)
+{
+    Q_D(FastDownloadDevice);
+
+    d->downloader = downloader;
+
+    if (downloader) {
+        connect(downloader, SIGNAL(readyRead(int)), this, SLOT(_q_readyRead(int)));
+        connect(downloader, SIGNAL(finished(int)), this, SLOT(_q_finished(int)));
+        connect(downloader, SIGNAL(finished()), this, SLOT(_q_finished()));
+    }
+}
+
+FastDownloadDevice::~FastDownloadDevice()
+{
+    if (isOpen())
+        close();
+}
+
+FastDownloader* FastDownloadDevice::downloader() const
+{
+    Q_D(const FastDownloadDevice);
+    return d->downloader;
+}
+
+qint64 FastDownloadDevice::maxBufferSize() const
+{
+    return m_maxBufferSize;
+}
+
+void FastDownloadDevice::setMaxBufferSize(qint64 maxBufferSize)
+{
+    Q_D(FastDownloadDevice);
+
+    if (maxBufferSize < FastDownloader::MIN_CHUNK_SIZE) {
+        qWarning("FastDownloadDevice::setMaxBufferSize: Buffer size is too small");
+        return;
+    }
+
+    m_maxBufferSize = maxBufferSize;
+
+    if (isOpen()) {
+        if (d->pullHeld())
+            QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
+        d->updateHint();
+    }
+}
+
+bool FastDownloadDevice::open(QIODevice::OpenMode mode)
+{
+    Q_D(FastDownloadDevice);
+
+    if (!d->downloader) {
+        qWarning("FastDownloadDevice::open: Downloader is null");
+        return false;
+    }
+
+    if (mode & WriteOnly) {
+        qWarning("FastDownloadDevice::open: Device is read only");
+        return false;
+    }
+
+    if (d->downloader->isRunning()) {
+        qWarning("FastDownloadDevice::open: Cannot open, the download is already in progress");
+        return false;
+    }
+
+    if (!d->downloader->outputFile().isEmpty()) {
+        qWarning("FastDownloadDevice::open: Cannot open, the downloader has an output file");
+        return false;
+    }
+
+    if (!d->downloader->ranges().isEmpty()) {
+        qWarning("FastDownloadDevice::open: Cannot open, the downloader has ranges set");
+        return false;
+    }
+
+    if (d->downloader->sink()) {
+        qWarning("FastDownloadDevice::open: Cannot open, the downloader has a sink");
+        return false;
+    }
+
+    if (d->downloader->progressInterval() > 0) {
+        qWarning("FastDownloadDevice::open: Cannot open, the downloader has a progress interval set");
+        return false;
+    }
+
+    // Replies held back must not buffer whatever comes
+    if (d->downloader->readBufferSize() <= 0) {
+        d->readBufferSizeChanged = true;
+        d->previousReadBufferSize = d->downloader->readBufferSize();
+        d->downloader->setReadBufferSize(qMax(qint64(FastDownloader::MIN_CHUNK_SIZE), m_maxBufferSize / HELD_READ_BUFFER_DIVISOR));
+    }
+
+    d->clear();
+
+    // We are the buffer ourselves
+    if (!QIODevice::open(mode | Unbuffered)) {
+        d->restoreReadBufferSize();
+        return false;
+    }
+
+    if (!d->downloader->start()) {
+        QIODevice::close();
+        d->restoreReadBufferSize();
+        return false;
+    }
+
+    d->updateHint();
+    return true;
+}
+
+void FastDownloadDevice::close()
+{
+    Q_D(FastDownloadDevice);
+
+    if (!isOpen())
+        return;
+
+    if (d->downloader && d->downloader->isRunning())
+        d->downloader->abort();
+
+    QIODevice::close();
+    d->clear();
+    d->restoreReadBufferSize();
+}
+
+bool FastDownloadDevice::isSequential() const
+{
+    return true;
+}
+
+bool FastDownloadDevice::atEnd() const
+{
+    Q_D(const FastDownloadDevice);
+    return !isOpen() || (d->downloadFinished && bytesAvailable() == 0);
+}
+
+qint64 FastDownloadDevice::bytesAvailable() const
+{
+    Q_D(const FastDownloadDevice);
+    return d->readyBytes + QIODevice::bytesAvailable();
+}
+
+bool FastDownloadDevice::waitForReadyRead(int msecs)
+{
+    Q_D(const FastDownloadDevice);
+
+    if (d->readyBytes > 0)
+        return true;
+
+    if (!isOpen() || d->downloadFinished)
+        return false;
+
+    QEventLoop loop;
+    connect(this, SIGNAL(readyRead()), &loop, SLOT(quit()));
+    connect(this, SIGNAL(readChannelFinished()), &loop, SLOT(quit()));
+    if (msecs >= 0)
+        QTimer::singleShot(msecs, &loop, SLOT(quit()));
+    loop.exec();
+
+    return d->readyBytes > 0;
+}
+
+qint64 FastDownloadDevice::readData(char* data, qint64 maxSize)
+{
+    Q_D(FastDownloadDevice);
+
+    qint64 length = 0;
+    while (length < maxSize && !d->ready.isEmpty()) {
+        QByteArray& first = d->ready.first();
+        const qint64 size = qMin(maxSize - length, qint64(first.size()));
+        memcpy(data + length, first.constData(), size_t(size));
+        length += size;
+        if (size == first.size())
+            d->ready.removeFirst();
+        else
+            first.remove(0, int(size));
+    }
+    d->readyBytes -= length;
+
+    // Room is made, so the ones held back can go on. Not emitted
+    // right away, we might be in the middle of a readyRead handler.
+    if (length > 0) {
+        if (d->pullHeld())
+            QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
+        d->updateHint();
+    }
+
+    if (length == 0 && d->downloadFinished)
+        return -1; // End of the stream
+
+    return length;
+}
+
+qint64 FastDownloadDevice::writeData(const char* /*data*/, qint64 /*maxSize*/)
+{
+    return -1;
+}
+
+#include "moc_fastdownloaddevice.cpp"
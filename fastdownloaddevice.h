@@ -0,0 +1,97 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADDEVICE_H
+#define FASTDOWNLOADDEVICE_H
+
+#include "fastdownloader_global.h"
+
+#include <QIODevice>
+
+/*!
+    Some notes:
+    A download device turns the chunks of a download into a plain sequential stream, delivered in
+    the order of the content, so you can start processing (i.e. decoding or parsing) the data
+    before the download is over. Bytes become available as soon as everything before them is
+    there; the "readyRead" signal is emitted whenever more is available, and "readChannelFinished"
+    once the download is over.
+
+    Opening the device starts the download, closing it aborts the download. The downloader must
+    not have an output file, since the device reads the chunks itself. Don't read from the
+    downloader yourself either.
+
+    Memory is bounded by "maxBufferSize" twice: once for the data that is ready but not read yet,
+    and once for the data arriving ahead of it. Connections running ahead are held back (their
+    data is left in their replies, whose read buffer is bounded as well; an eighth of
+    "maxBufferSize" if the downloader doesn't set one) and the downloader is told to keep its
+    connections within that distance of the position being read, with chunks small enough for
+    all of them to fit in there.
+ */
+
+class FastDownloader;
+class FastDownloadDevicePrivate;
+class FASTDOWNLOADER_EXPORT FastDownloadDevice : public QIODevice
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(FastDownloadDevice)
+    Q_DECLARE_PRIVATE(FastDownloadDevice)
+
+public:
+    enum {
+        // The default maximum size of the data kept in memory, for each of in order and out of order
+        // data (16 Mb).
+        DEFAULT_MAX_BUFFER_SIZE = 16777216
+    };
+
+public:
+    explicit FastDownloadDevice(FastDownloader* downloader, QObject* parent = nullptr);
+    ~FastDownloadDevice() override;
+
+    FastDownloader* downloader() const;
+
+    qint64 maxBufferSize() const;
+    void setMaxBufferSize(qint64 maxBufferSize);
+
+    bool open(OpenMode mode) override;
+    void close() override;
+
+    bool isSequential() const override;
+    bool atEnd() const override;
+    qint64 bytesAvailable() const override;
+    bool waitForReadyRead(int msecs) override;
+
+protected:
+    FastDownloadDevice(FastDownloadDevicePrivate& dd, FastDownloader* downloader, QObject* parent);
+
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char* data, qint64 maxSize) override;
+
+private:
+    Q_PRIVATE_SLOT(d_func(), void _q_readyRead(int))
+    Q_PRIVATE_SLOT(d_func(), void _q_finished(int))
+    Q_PRIVATE_SLOT(d_func(), void _q_finished())
+
+private:
+    qint64 m_maxBufferSize;
+};
+
+#endif // FASTDOWNLOADDEVICE_H
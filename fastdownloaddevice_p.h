@@ -0,0 +1,63 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADDEVICE_P_H
+#define FASTDOWNLOADDEVICE_P_H
+
+#include "fastdownloaddevice.h"
+#include "fastdownloader.h"
+#include <private/qiodevice_p.h>
+#include <QPointer>
+#include <QMap>
+#include <QSet>
+
+class FastDownloadDevicePrivate : public QIODevicePrivate
+{
+    Q_DECLARE_PUBLIC(FastDownloadDevice)
+
+public:
+    FastDownloadDevicePrivate();
+
+    void clear();
+    qint64 pull(int id, bool force);
+    bool pullHeld();
+    void takePending();
+    void updateHint() const;
+    void restoreReadBufferSize();
+
+    QPointer<FastDownloader> downloader;
+    bool downloadFinished;
+    qint64 readyEnd; // Offset right after the data in order
+    qint64 readyBytes;
+    QList<QByteArray> ready; // In order, not read yet
+    qint64 pendingBytes;
+    QMap<qint64, QByteArray> pending; // Out of order, by offset
+    QSet<int> held; // Connections with data left in their replies
+    bool readBufferSizeChanged; // By open, restored on close
+    qint64 previousReadBufferSize;
+
+    void _q_readyRead(int id);
+    void _q_finished(int id);
+    void _q_finished();
+};
+
+#endif // FASTDOWNLOADDEVICE_P_H
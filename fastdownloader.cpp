@@ -21,17 +21,139 @@
 ****************************************************************************/
 
 #include "fastdownloader_p.h"
+#include "fastdownloadhasher_p.h"
+#include "fastdownloadworker_p.h"
+#include "fastdownloadsink.h"
+#include "fastdownloadqueue_p.h"
 #include <QRandomGenerator>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QTimer>
+#include <QHash>
+#include <QVector>
+#include <QNetworkCookieJar>
+#include <QAbstractNetworkCache>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+#  include <QHttp2Configuration>
+#endif
+
+#include <algorithm>
+#include <limits>
+
+static const quint32 JOURNAL_MAGIC = 0x46444a4c; // "FDJL"
+static const quint32 JOURNAL_VERSION = 1;
+
+static const int MONITOR_INTERVAL = 1000; // ms
+static const int AUTO_INITIAL_CONNECTIONS = 3;
+static const int AUTO_WINDOW_TICKS = 3; // Throughput is compared over windows of that many ticks
+static const int AUTO_SETTLE_WINDOWS = 5; // Windows to wait before probing again after a failed probe
+static const qint64 AUTO_PROBE_CHUNK_SIZE = 524288; // Chunk size for connections of unknown speed
+static const qint64 AUTO_CHUNK_DURATION = 4000; // ms, the time a chunk is supposed to take at least
+static const qint64 AUTO_CHUNK_LATENCY_FACTOR = 20; // Chunks take at least that many round trips
+static const qint64 AUTO_CHUNK_GROWTH = 4; // A chunk is at most that many times its predecessor
+static const qint64 IDLE_THRESHOLD = 500; // ms, longer gaps between data deliveries count as idle time
+static const int MIRROR_MAX_FAILURES = 2; // A mirror is dropped when its connections fail that many times
+static const int THROTTLE_INTERVAL = 50; // ms, held back data is delivered again this often
+static const qint64 THROTTLE_MIN_BUFFER_SIZE = 16384; // Read buffers don't get smaller under a bandwidth limit
+static const qint64 PRIORITY_CHUNK_SIZE = 131072; // At the priority position, chunks get larger further away
+static const int READ_BUFFER_SIZE = 262144; // Data is read from the replies in blocks of that size at most
+static const int READ_BUFFER_POOL_SIZE = 16; // Buffers kept for reuse at most
+static const qint64 MEMORY_MIN_SHARE = 16384; // Nor under a memory budget
+static const int MULTIPART_MAX_RANGES = 64; // Ranges packed into a single request at most
+static const qint64 MULTIPART_MAX_PART_SIZE = 65536; // Larger ranges get connections of their own
+static const int HTTP2_STREAM_WINDOW_SIZE = 8388608; // Large windows, so bulk streams never wait for WINDOW_UPDATE
+static const int HTTP2_SESSION_WINDOW_SIZE = 67108864;
+static const int HTTP2_MAX_FRAME_SIZE = 262144;
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+static const QNetworkRequest::Attribute HTTP2_ALLOWED_ATTRIBUTE = QNetworkRequest::Http2AllowedAttribute;
+static const QNetworkRequest::Attribute HTTP2_WAS_USED_ATTRIBUTE = QNetworkRequest::Http2WasUsedAttribute;
+#else
+static const QNetworkRequest::Attribute HTTP2_ALLOWED_ATTRIBUTE = QNetworkRequest::HTTP2AllowedAttribute;
+static const QNetworkRequest::Attribute HTTP2_WAS_USED_ATTRIBUTE = QNetworkRequest::HTTP2WasUsedAttribute;
+#endif
+
+FastDownloaderPrivate::TokenBucket FastDownloaderPrivate::globalBandwidth;
+QMutex FastDownloaderPrivate::globalBandwidthMutex;
+QList<QByteArray> FastDownloaderPrivate::readBufferPool;
+QMutex FastDownloaderPrivate::readBufferPoolMutex;
+qint64 FastDownloaderPrivate::globalMemoryBudget = 0;
+int FastDownloaderPrivate::globalConnectionCount = 0;
+QMutex FastDownloaderPrivate::globalMemoryMutex;
+
+void FastDownloaderPrivate::TokenBucket::setRate(qint64 rate, qint64 burst)
+{
+    this->rate = qMax(qint64(0), rate);
+    this->burst = burst > 0 ? burst : qMax(this->rate / 4, THROTTLE_MIN_BUFFER_SIZE);
+    if (!clock.isValid()) {
+        clock.start();
+        refillTime = 0;
+        tokens = this->burst;
+    }
+    tokens = qMin(tokens, qreal(this->burst));
+}
+
+qint64 FastDownloaderPrivate::TokenBucket::available()
+{
+    if (rate <= 0)
+        return std::numeric_limits<qint64>::max();
+
+    const qint64 now = clock.nsecsElapsed();
+    tokens = qMin(qreal(burst), tokens + (now - refillTime) * rate / 1e9);
+    refillTime = now;
+    return qint64(tokens);
+}
+
+void FastDownloaderPrivate::TokenBucket::consume(qint64 length)
+{
+    if (rate > 0)
+        tokens -= length;
+}
 
 FastDownloaderPrivate::FastDownloaderPrivate() : QObjectPrivate()
   , manager(new QNetworkAccessManager)
+  , queue(nullptr)
   , running(false)
   , resolved(false)
   , simultaneousDownloadPossible(false)
+  , requestingRanges(false)
+  , multipartRefused(false)
+  , http2Used(false)
   , contentLength(0)
+  , requestedLength(0)
   , totalBytesReceived(0)
   , error(QNetworkReply::NoError)
-{
+  , sequentialPosition(0)
+  , sequentialWindow(0)
+  , connectionLimit(0)
+  , connectionBudget(std::numeric_limits<int>::max())
+  , currentSpeed(0)
+  , requestCount(0)
+  , retryCount(0)
+  , stallCount(0)
+  , bytesHedged(0)
+  , bytesWasted(0)
+  , idleTime(0)
+  , stopTime(0)
+  , appliedReadBufferSize(0)
+  , appliedMemoryBudget(0)
+  , throttleTurn(0)
+  , journalTimer(nullptr)
+  , retryTimer(nullptr)
+  , monitorTimer(nullptr)
+  , throttleTimer(nullptr)
+  , progressTimer(nullptr)
+  , hashThread(nullptr)
+  , hasher(nullptr)
+{
+}
+
+FastDownloaderPrivate::~FastDownloaderPrivate()
+{
+    stopHashing();
+    stopWorkers();
+    qDeleteAll(extraManagers);
 }
 
 int FastDownloaderPrivate::generateUniqueId() const
@@ -45,10 +167,10 @@ int FastDownloaderPrivate::generateUniqueId() const
 
 bool FastDownloaderPrivate::downloadCompleted() const
 {
-    if (nextPortionAvailable())
+    if (nextPortionAvailable() || !failedPortions.isEmpty())
         return false;
     for (Connection* connection : connections) {
-        if (connection->reply->isRunning())
+        if (connection->reply->isRunning() || connection->draining)
             return false;
     }
     return true;
@@ -56,76 +178,376 @@ bool FastDownloaderPrivate::downloadCompleted() const
 
 bool FastDownloaderPrivate::connectionExists(int id) const
 {
+    return connectionsById.contains(id);
+}
+
+bool FastDownloaderPrivate::nextPortionAvailable() const
+{
+    return simultaneousDownloadPossible && !portions.isEmpty();
+}
+
+qint64 FastDownloaderPrivate::nextPortionPosition() const
+{
+    Q_Q(const FastDownloader);
+    if (!nextPortionAvailable())
+        return -1;
+
+    // See takePortion, a portion across the priority position is taken from there
+    const Portion& portion = portions.at(nextPortionIndex());
+    if (portion.head + portion.size > q->priorityPosition())
+        return qMax(portion.head, q->priorityPosition());
+    return portion.head;
+}
+
+int FastDownloaderPrivate::nextPortionIndex() const
+{
+    Q_Q(const FastDownloader);
+
+    // The first one reaching beyond the priority position, or the
+    // very first one if there is nothing left beyond it
+    const qint64 priority = q->priorityPosition();
+    if (priority > 0) {
+        for (int i = 0; i < portions.size(); ++i) {
+            if (portions.at(i).head + portions.at(i).size > priority)
+                return i;
+        }
+    }
+    return 0;
+}
+
+bool FastDownloaderPrivate::withinSequentialWindow(qint64 position) const
+{
+    return sequentialWindow <= 0 || position < sequentialPosition + sequentialWindow;
+}
+
+void FastDownloaderPrivate::setSequentialHint(qint64 position, qint64 window)
+{
+    sequentialPosition = position;
+    sequentialWindow = window;
+    fillConnections();
+}
+
+qint64 FastDownloaderPrivate::priorityDistance(qint64 position) const
+{
+    Q_Q(const FastDownloader);
+
+    // What is before the priority position comes after the end of the content
+    const qint64 priority = q->priorityPosition();
+    if (priority < 0 || position >= priority)
+        return position - qMax(priority, qint64(0));
+    return contentLength - priority + position;
+}
+
+qint64 FastDownloaderPrivate::priorityChunkSize(qint64 position) const
+{
+    Q_Q(const FastDownloader);
+
+    // Each chunk beyond the priority position is at most as large as the distance to it, so
+    // chunk sizes double as they get away from it
+    if (q->priorityPosition() < 0 || position < 0)
+        return std::numeric_limits<qint64>::max();
+    return qMax(PRIORITY_CHUNK_SIZE, priorityDistance(position));
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionFarthestFromPriority() const
+{
+    Connection* farthest = nullptr;
+    qint64 farthestDistance = -1;
     for (Connection* connection : connections) {
-        if (connection->id == id)
-            return true;
+        if (connection->dismissed
+                || connection->multipart
+                || connection->twin
+                || connection->bytesTotal - connection->bytesReceived < FastDownloader::MIN_SPLIT_SIZE
+                || !connection->reply->isRunning()) {
+            continue;
+        }
+        const qint64 distance = priorityDistance(connection->head + connection->bytesReceived);
+        if (distance > farthestDistance) {
+            farthest = connection;
+            farthestDistance = distance;
+        }
     }
-    return false;
+    return farthest;
 }
 
-bool FastDownloaderPrivate::nextPortionAvailable() const
+void FastDownloaderPrivate::reprioritize()
 {
     Q_Q(const FastDownloader);
 
-    if (simultaneousDownloadPossible
-            && q->chunkSizeLimit() > 0
-            && q->numberOfSimultaneousConnections() > 1) {
-        qint64 bytesTotal = 0;
-        for (Connection* connection : connections)
-            bytesTotal += connection->bytesTotal;
-        if (bytesTotal < contentLength)
-            return true;
-        else
-            return false;
-    } else {
-        return false;
+    const qint64 priority = q->priorityPosition();
+    if (!running || !resolved || !simultaneousDownloadPossible || priority < 0)
+        return;
+
+    // A connection that would get to the position only after a while leaves the rest to others
+    for (Connection* connection : connections) {
+        if (connection->dismissed
+                || connection->multipart
+                || connection->twin
+                || connection->bytesTotal <= 0
+                || !connection->reply->isRunning()) {
+            continue;
+        }
+        const qint64 begin = connection->head + connection->bytesReceived;
+        const qint64 end = connection->head + connection->bytesTotal;
+        if (priority >= begin + PRIORITY_CHUNK_SIZE && priority < end) {
+            Portion portion;
+            portion.head = priority;
+            portion.size = end - priority;
+            portion.retries = connection->retries;
+            connection->bytesTotal = priority - connection->head;
+            connection->truncated = true;
+            insertPortion(portion);
+            break;
+        }
+    }
+
+    // And if there is no room for a new connection, the farthest one makes room
+    const qint64 next = nextPortionPosition();
+    Connection* farthest = connectionFarthestFromPriority();
+    if (next >= 0
+            && farthest
+            && activeConnectionCount() >= effectiveConnectionLimit()
+            && priorityDistance(next) < priorityDistance(farthest->head + farthest->bytesReceived)) {
+        releaseConnection(farthest);
     }
+
+    fillConnections();
 }
 
-qint64 FastDownloaderPrivate::nextPortionPosition() const
+int FastDownloaderPrivate::effectiveConnectionLimit() const
 {
-    if (!nextPortionAvailable())
-        return -1;
+    return qMin(connectionLimit, connectionBudget);
+}
+
+QNetworkAccessManager* FastDownloaderPrivate::primaryManager() const
+{
+    return queue ? queue->manager.data() : manager.data();
+}
+
+void FastDownloaderPrivate::setConnectionBudget(int budget)
+{
+    const int previousLimit = effectiveConnectionLimit();
+    connectionBudget = budget;
+    if (effectiveConnectionLimit() > previousLimit) {
+        fillConnections();
+        return;
+    }
 
-    qint64 nextPos = 0;
+    // Over the budget, the connections with the most left to receive hand their
+    // remaining ranges back to the scheduler, the rest takes them over as it goes
+    int active = 0;
+    QList<Connection*> candidates;
     for (Connection* connection : connections) {
-        qint64 end = connection->head + connection->bytesTotal;
-        if (end > nextPos)
-            nextPos = end;
+        if (connection->dismissed || !connection->reply->isRunning())
+            continue;
+        // Already let go, only delivering what it has received
+        if (connection->truncated && connection->bytesReceived >= connection->bytesTotal)
+            continue;
+        ++active;
+        if (!connection->multipart
+                && !connection->hedge
+                && connection->bytesReceived < connection->bytesTotal) {
+            candidates.append(connection);
+        }
     }
+    std::sort(candidates.begin(), candidates.end(), [] (const Connection* a, const Connection* b) {
+        return a->bytesTotal - a->bytesReceived > b->bytesTotal - b->bytesReceived;
+    });
+
+    const int surplus = active - effectiveConnectionLimit();
+    for (int i = 0; i < surplus && i < candidates.size(); ++i)
+        releaseConnection(candidates.at(i));
+}
 
-    return nextPos;
+int FastDownloaderPrivate::activeConnectionCount() const
+{
+    int count = 0;
+    for (Connection* connection : connections) {
+        if (!connection->dismissed && connection->reply->isRunning())
+            ++count;
+    }
+    return count;
 }
 
 qint64 FastDownloaderPrivate::untargetedDataSize() const
 {
     qint64 bytesTotal = 0;
+    for (const Portion& portion : portions)
+        bytesTotal += portion.size;
+    return bytesTotal;
+}
+
+FastDownloaderPrivate::Portion FastDownloaderPrivate::takePortion(qint64 maxSize)
+{
+    Q_Q(const FastDownloader);
+    Q_ASSERT(!portions.isEmpty());
+
+    // What is before the priority position stays for later
+    int index = nextPortionIndex();
+    const qint64 priority = q->priorityPosition();
+    if (portions.at(index).head < priority && portions.at(index).head + portions.at(index).size > priority) {
+        Portion before(portions.at(index));
+        before.size = priority - before.head;
+        portions[index].head = priority;
+        portions[index].size -= before.size;
+        portions.insert(index++, before);
+    }
+
+    return takePortionAt(index, maxSize);
+}
+
+FastDownloaderPrivate::Portion FastDownloaderPrivate::takePortionAt(int index, qint64 maxSize)
+{
+    Q_ASSERT(index >= 0 && index < portions.size() && maxSize > 0);
+
+    Portion& first = portions[index];
+    if (first.size <= maxSize)
+        return portions.takeAt(index);
+
+    Portion portion;
+    portion.head = first.head;
+    portion.size = maxSize;
+    portion.retries = first.retries;
+    first.head += maxSize;
+    first.size -= maxSize;
+    return portion;
+}
+
+QList<FastDownloaderPrivate::Portion> FastDownloaderPrivate::remainingPortions() const
+{
+    QList<Portion> remaining(portions + failedPortions);
     for (Connection* connection : connections)
-        bytesTotal += connection->bytesTotal;
-    return contentLength - bytesTotal;
+        remaining.append(pendingPortions(connection));
+
+    std::sort(remaining.begin(), remaining.end(), [] (const Portion& a, const Portion& b) {
+        return a.head < b.head;
+    });
+
+    QList<Portion> merged;
+    for (const Portion& portion : remaining) {
+        if (!merged.isEmpty() && merged.last().head + merged.last().size >= portion.head) {
+            Portion& last = merged.last();
+            last.size = qMax(last.head + last.size, portion.head + portion.size) - last.head;
+        } else {
+            merged.append(portion);
+        }
+    }
+    return merged;
 }
 
-FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionFor(int id) const
+QList<FastDownloaderPrivate::Portion> FastDownloaderPrivate::pendingPortions(const FastDownloaderPrivate::Connection* connection) const
 {
-    for (Connection* connection : connections) {
-        if (connection->id == id)
-            return connection;
+    if (connection->multipart)
+        return connection->multipart->parts;
+
+    QList<Portion> pending;
+    if (connection->bytesTotal > connection->pos) {
+        Portion portion;
+        portion.head = connection->head + connection->pos;
+        portion.size = connection->bytesTotal - connection->pos;
+        portion.retries = connection->retries;
+        pending.append(portion);
     }
-    return nullptr;
+    return pending;
 }
 
-FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionFor(const QObject* sender) const
+QList<FastDownloaderPrivate::Portion> FastDownloaderPrivate::takeSmallPortions(qint64 maxSize)
 {
-    const auto reply = qobject_cast<const QNetworkReply*>(sender);
-    Q_ASSERT(reply);
+    // Only the ones next in line, a large one ends the batch
+    QList<Portion> parts;
+    qint64 size = 0;
+    while (parts.size() < MULTIPART_MAX_RANGES && !portions.isEmpty()) {
+        const Portion& portion = portions.first();
+        if (portion.size > MULTIPART_MAX_PART_SIZE
+                || !withinSequentialWindow(portion.head)
+                || (!parts.isEmpty() && size + portion.size > maxSize)) {
+            break;
+        }
+        size += portion.size;
+        parts.append(portions.takeFirst());
+    }
+    return parts;
+}
 
-    for (Connection* connection : connections) {
-        if (connection->reply == reply)
-            return connection;
+bool FastDownloaderPrivate::multipartPossible() const
+{
+    Q_Q(const FastDownloader);
+    return q->isMultipartRequestsEnabled()
+            && file
+            && !multipartRefused
+            && portions.size() > 1
+            && portions.at(0).size <= MULTIPART_MAX_PART_SIZE
+            && portions.at(1).size <= MULTIPART_MAX_PART_SIZE;
+}
+
+qint64 FastDownloaderPrivate::requestedSize(qint64 contentLength) const
+{
+    Q_Q(const FastDownloader);
+
+    if (q->ranges().isEmpty())
+        return contentLength;
+
+    qint64 size = 0;
+    for (const Portion& portion : normalizedRanges(q->ranges(), contentLength))
+        size += portion.size;
+    return size;
+}
+
+QByteArray FastDownloaderPrivate::validator() const
+{
+    // Weak entity tags are not allowed in If-Range
+    if (!entityTag.isEmpty() && !entityTag.startsWith("W/"))
+        return entityTag;
+    return lastModified;
+}
+
+bool FastDownloaderPrivate::throttled(FastDownloaderPrivate::Connection* connection) const
+{
+    const qint64 pending = readLimit(connection, connection->reply->bytesAvailable());
+    return pending > 0 && readAllowance(connection, pending) < pending;
+}
+
+qint64 FastDownloaderPrivate::readAllowance(FastDownloaderPrivate::Connection* connection, qint64 maxSize) const
+{
+    qint64 allowance = qMin(readLimit(connection, maxSize), connection->bandwidth.available());
+    allowance = qMin(allowance, bandwidth.available());
+
+    QMutexLocker locker(&globalBandwidthMutex);
+    return qMin(allowance, globalBandwidth.available());
+}
+
+qint64 FastDownloaderPrivate::effectiveReadBufferSize() const
+{
+    Q_Q(const FastDownloader);
+
+    qint64 rate = 0;
+    for (qint64 limit : {q->maxBandwidth(), q->maxConnectionBandwidth(), FastDownloader::globalMaxBandwidth()}) {
+        if (limit > 0)
+            rate = rate > 0 ? qMin(rate, limit) : limit;
     }
 
-    Q_ASSERT(0);
-    return nullptr;
+    if (rate <= 0)
+        return q->readBufferSize();
+
+    // Once a bounded buffer is full, the reply stops reading from the
+    // socket, so the server is slowed down by TCP flow control
+    const qint64 size = qMax(rate / 4, THROTTLE_MIN_BUFFER_SIZE);
+    return q->readBufferSize() > 0 ? qMin(q->readBufferSize(), size) : size;
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionFor(int id) const
+{
+    return connectionsById.value(id);
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionFor(const QObject* sender) const
+{
+    Q_ASSERT(qobject_cast<const QNetworkReply*>(sender));
+
+    // Looked up for every packet, so not by going through the connections
+    Connection* connection = connectionsByReply.value(sender);
+    Q_ASSERT(connection);
+    return connection;
 }
 
 QList<FastDownloaderPrivate::Connection> FastDownloaderPrivate::createFakeCopyForActiveConnections() const
@@ -143,11 +565,96 @@ QList<FastDownloaderPrivate::Connection> FastDownloaderPrivate::createFakeCopyFo
     return fakeCopy;
 }
 
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionToSplit() const
+{
+    Connection* largest = nullptr;
+    qint64 largestRemaining = 0;
+    for (Connection* connection : connections) {
+        if (connection->dismissed
+                || connection->multipart
+                || connection->twin
+                || connection->bytesTotal <= 0
+                || !connection->reply->isRunning()) {
+            continue;
+        }
+        const qint64 remaining = connection->bytesTotal - connection->bytesReceived;
+        if (remaining > largestRemaining) {
+            largest = connection;
+            largestRemaining = remaining;
+        }
+    }
+    if (largestRemaining < FastDownloader::MIN_SPLIT_SIZE)
+        return nullptr;
+    return largest;
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::connectionToHedge() const
+{
+    Q_Q(const FastDownloader);
+
+    // End game only, copies are written into the file right over the originals
+    if (!file || untargetedDataSize() > 0)
+        return nullptr;
+
+    const qint64 now = clock.elapsed();
+    Connection* slowest = nullptr;
+    qreal slowestTimeLeft = -1;
+    for (Connection* connection : connections) {
+        const qint64 remaining = connection->bytesTotal - connection->bytesReceived;
+        if (connection->dismissed
+                || connection->multipart
+                || connection->hedge
+                || connection->twin
+                || connection->bytesTotal <= 0
+                || remaining <= 0
+                || bytesHedged + remaining > q->maxHedgedBytes()
+                || now - connection->startTime < MONITOR_INTERVAL // Speed not known yet
+                || !connection->reply->isRunning()) {
+            continue;
+        }
+        const qreal timeLeft = connection->currentSpeed > 0
+                ? remaining / connection->currentSpeed : std::numeric_limits<qreal>::max();
+        if (timeLeft > slowestTimeLeft) {
+            slowest = connection;
+            slowestTimeLeft = timeLeft;
+        }
+    }
+    return slowest;
+}
+
 void FastDownloaderPrivate::free()
 {
+    Q_Q(const FastDownloader);
+
     const QList<Connection*> copy(connections);
     for (Connection* connection : copy)
         deleteConnection(connection);
+    for (const Mirror& mirror : mirrors) {
+        if (mirror.probe) {
+            mirror.probe->disconnect(q);
+            mirror.probe->abort();
+            mirror.probe->deleteLater();
+        }
+    }
+    mirrors.clear();
+    file.reset();
+    portions.clear();
+    failedPortions.clear();
+    stopTime = clock.isValid() ? clock.elapsed() : 0;
+    currentSpeed = 0;
+    if (journalTimer)
+        journalTimer->stop();
+    if (retryTimer)
+        retryTimer->stop();
+    if (monitorTimer)
+        monitorTimer->stop();
+    if (throttleTimer)
+        throttleTimer->stop();
+    if (progressTimer)
+        progressTimer->stop();
+    releaseReadBuffer();
+    stopHashing();
+    stopWorkers();
 }
 
 void FastDownloaderPrivate::reset()
@@ -156,345 +663,2482 @@ void FastDownloaderPrivate::reset()
     resolved = false;
     simultaneousDownloadPossible = false;
     resolvedUrl.clear();
+    warmedUpOrigins.clear();
+    requestingRanges = false;
+    multipartRefused = false;
+    http2Used = false;
     contentLength = 0;
+    requestedLength = 0;
     totalBytesReceived = 0;
     error = QNetworkReply::NoError;
+    entityTag.clear();
+    lastModified.clear();
+    digest.clear();
+    portions.clear();
+    failedPortions.clear();
+    mirrors.clear();
+    sequentialPosition = 0;
+    sequentialWindow = 0;
+    clock.start();
+    appliedReadBufferSize = effectiveReadBufferSize();
+    appliedMemoryBudget = 0; // See applyReadBufferSize, once there are connections
+    throttleTurn = 0;
+    sampledBytes = 0;
+    sampledTime = 0;
+    autoWindowBytes = 0;
+    autoWindowTime = 0;
+    autoWindowTicks = 0;
+    autoSettle = 0;
+    autoProbing = false;
+    autoThroughput = 0;
+    currentSpeed = 0;
+    requestCount = 0;
+    retryCount = 0;
+    stallCount = 0;
+    bytesHedged = 0;
+    bytesWasted = 0;
+    idleTime = 0;
+    stopTime = 0;
+}
+
+bool FastDownloaderPrivate::loadJournal()
+{
+    Q_Q(const FastDownloader);
+
+    QFile journal(q->journalFile());
+    if (!journal.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream in(&journal);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version, count;
+    QUrl url, journalResolvedUrl;
+    QByteArray journalEntityTag, journalLastModified;
+    qint64 journalContentLength;
+
+    in >> magic >> version;
+    if (in.status() != QDataStream::Ok || magic != JOURNAL_MAGIC || version != JOURNAL_VERSION)
+        return false;
+
+    in >> url >> journalResolvedUrl >> journalEntityTag >> journalLastModified
+       >> journalContentLength >> count;
+    if (in.status() != QDataStream::Ok || url != q->url() || journalContentLength <= 0)
+        return false;
+
+    QList<Portion> journalPortions;
+    for (quint32 i = 0; i < count; ++i) {
+        Portion portion;
+        in >> portion.head >> portion.size;
+        if (in.status() != QDataStream::Ok
+                || portion.head < 0 || portion.size <= 0
+                || portion.head + portion.size > journalContentLength) {
+            return false;
+        }
+        journalPortions.append(portion);
+    }
+
+    if (journalPortions.isEmpty())
+        return false;
+
+    entityTag = journalEntityTag;
+    lastModified = journalLastModified;
+    if (validator().isEmpty()) {
+        entityTag.clear();
+        lastModified.clear();
+        return false;
+    }
+
+    contentLength = journalContentLength;
+    requestedLength = requestedSize(contentLength);
+    portions = journalPortions;
+    totalBytesReceived = requestedLength - untargetedDataSize();
+    return true;
+}
+
+void FastDownloaderPrivate::saveJournal() const
+{
+    Q_Q(const FastDownloader);
+
+    if (q->journalFile().isEmpty()
+            || !resolved
+            || !simultaneousDownloadPossible
+            || validator().isEmpty()) {
+        return;
+    }
+
+    const QList<Portion>& remaining = remainingPortions();
+
+    QSaveFile journal(q->journalFile());
+    if (!journal.open(QIODevice::WriteOnly)) {
+        qWarning("FastDownloader: Cannot save the journal, %s", qPrintable(journal.errorString()));
+        return;
+    }
+
+    QDataStream out(&journal);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << JOURNAL_MAGIC << JOURNAL_VERSION << q->url() << resolvedUrl << entityTag << lastModified
+        << contentLength << quint32(remaining.size());
+    for (const Portion& portion : remaining)
+        out << portion.head << portion.size;
+
+    if (!journal.commit())
+        qWarning("FastDownloader: Cannot save the journal, %s", qPrintable(journal.errorString()));
+}
+
+void FastDownloaderPrivate::dispatch(FastDownloaderPrivate::Connection* connection)
+{
+    Q_Q(FastDownloader);
+    if (file || q->sink()) {
+        deliver(connection);
+    } else if (q->progressInterval() > 0) {
+        connection->readyReadPending = true;
+        scheduleProgress();
+    } else {
+        emit q->readyRead(connection->id);
+    }
+
+    // Whatever the bandwidth limit holds back is delivered later on
+    if (running && connections.contains(connection) && throttled(connection))
+        scheduleThrottle();
+}
+
+void FastDownloaderPrivate::deliver(FastDownloaderPrivate::Connection* connection)
+{
+    if (file)
+        writeToFile(connection);
+    else
+        writeToSink(connection);
+}
+
+void FastDownloaderPrivate::writeToFile(FastDownloaderPrivate::Connection* connection)
+{
+    Q_Q(FastDownloader);
+    Q_ASSERT(file);
+
+    if (connection->multipart) {
+        writeMultipart(connection);
+        return;
+    }
+
+    qint64 length = readAllowance(connection, connection->reply->bytesAvailable());
+    while (length > 0) {
+        char* data = readBuffer();
+        const qint64 size = connection->reply->read(data, qMin(length, qint64(READ_BUFFER_SIZE)));
+        if (size <= 0)
+            return;
+
+        if (!file->seek(connection->head + connection->pos) || file->write(data, size) != size) {
+            qWarning("FastDownloader: Cannot write into the output file, %s",
+                     qPrintable(file->errorString()));
+            error = QNetworkReply::UnknownContentError;
+            q->abort();
+            return;
+        }
+
+        hash(connection, data, size);
+        advance(connection, size);
+        length -= size;
+    }
+}
+
+void FastDownloaderPrivate::writeToSink(FastDownloaderPrivate::Connection* connection)
+{
+    Q_Q(FastDownloader);
+    Q_ASSERT(q->sink());
+
+    qint64 length = readAllowance(connection, connection->reply->bytesAvailable());
+    while (length > 0) {
+        char* data = readBuffer();
+        const qint64 size = connection->reply->read(data, qMin(length, qint64(READ_BUFFER_SIZE)));
+        if (size <= 0)
+            return;
+
+        if (!q->sink()->consume(connection->head + connection->pos, data, size)) {
+            if (running) {
+                qWarning("FastDownloader: Data refused by the sink");
+                error = QNetworkReply::UnknownContentError;
+                q->abort();
+            }
+            return;
+        }
+
+        // The sink may have aborted the download in the meantime
+        if (!running || !connections.contains(connection))
+            return;
+
+        hash(connection, data, size);
+        advance(connection, size);
+        length -= size;
+    }
+}
+
+char* FastDownloaderPrivate::readBuffer()
+{
+    if (buffer.isEmpty()) {
+        QMutexLocker locker(&readBufferPoolMutex);
+        buffer = readBufferPool.isEmpty() ? QByteArray(READ_BUFFER_SIZE, Qt::Uninitialized) : readBufferPool.takeLast();
+    }
+    return buffer.data();
+}
+
+void FastDownloaderPrivate::releaseReadBuffer()
+{
+    if (buffer.isEmpty())
+        return;
+
+    QMutexLocker locker(&readBufferPoolMutex);
+    if (readBufferPool.size() < READ_BUFFER_POOL_SIZE)
+        readBufferPool.append(buffer);
+    buffer.clear();
+}
+
+void FastDownloaderPrivate::writeMultipart(FastDownloaderPrivate::Connection* connection)
+{
+    Q_Q(FastDownloader);
+
+    Multipart* multipart = connection->multipart;
+    QNetworkReply* reply = connection->reply;
+    if (multipart->delimiter.isEmpty()) // Not accepted yet, see acceptMultipart
+        return;
+
+    // Part bodies are taken by their length (see Content-Range), delimiters and headers line by line
+    while (running && !multipart->done) {
+        if (multipart->partPos < multipart->partSize) {
+            const qint64 left = multipart->partSize - multipart->partPos;
+            const QByteArray& data = reply->read(readAllowance(connection, qMin(left, reply->bytesAvailable())));
+            if (data.isEmpty())
+                return;
+
+            const qint64 offset = multipart->partHead + multipart->partPos;
+            if (!file->seek(offset) || file->write(data) != data.size()) {
+                qWarning("FastDownloader: Cannot write into the output file, %s",
+                         qPrintable(file->errorString()));
+                error = QNetworkReply::UnknownContentError;
+                q->abort();
+                return;
+            }
+
+            if (hasher) {
+                QMetaObject::invokeMethod(hasher, "addData", Qt::QueuedConnection, Q_ARG(int, connection->id),
+                                          Q_ARG(qint64, offset), Q_ARG(QByteArray, data));
+            }
+
+            multipart->partPos += data.size();
+            subtractRange(multipart->parts, offset, data.size());
+            advance(connection, data.size());
+            connection->bytesReceived = connection->pos;
+            totalBytesReceived += data.size();
+
+            // Each part is hashed on its own
+            if (hasher && multipart->partPos == multipart->partSize)
+                QMetaObject::invokeMethod(hasher, "finishChunk", Qt::QueuedConnection, Q_ARG(int, connection->id));
+            continue;
+        }
+
+        if (!reply->canReadLine())
+            return;
+
+        const QByteArray& line = reply->readLine().trimmed();
+        if (line.startsWith(multipart->delimiter)) {
+            multipart->done = line == multipart->delimiter + "--";
+            multipart->inHeaders = !multipart->done;
+            multipart->partHead = -1;
+            multipart->partSize = multipart->partPos = 0;
+        } else if (multipart->inHeaders && line.isEmpty()) {
+            multipart->inHeaders = false;
+            if (multipart->partHead < 0
+                    || !containsRange(multipart->parts, multipart->partHead, multipart->partSize)) {
+                qWarning("FastDownloader: Malformed multipart response");
+                fallBackFromMultipart(connection);
+                return;
+            }
+        } else if (multipart->inHeaders && line.toLower().startsWith("content-range:")) {
+            qint64 begin, end, total;
+            if (parseContentRange(line.mid(14).trimmed(), &begin, &end, &total) && total == contentLength) {
+                multipart->partHead = begin;
+                multipart->partSize = end - begin + 1;
+            }
+        }
+    }
+}
+
+bool FastDownloaderPrivate::acceptMultipart(FastDownloaderPrivate::Connection* connection)
+{
+    QNetworkReply* reply = connection->reply;
+    if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 206)
+        return false;
+
+    // i.e. "multipart/byteranges; boundary=THIS_STRING_SEPARATES"
+    const QByteArray& contentType = reply->rawHeader("Content-Type").trimmed();
+    const int index = contentType.toLower().indexOf("boundary=");
+    if (!contentType.toLower().startsWith("multipart/byteranges") || index < 0)
+        return false;
+
+    QByteArray boundary = contentType.mid(index + 9);
+    if (boundary.contains(';'))
+        boundary.truncate(boundary.indexOf(';'));
+    boundary = boundary.trimmed();
+    if (boundary.size() > 1 && boundary.startsWith('"') && boundary.endsWith('"'))
+        boundary = boundary.mid(1, boundary.size() - 2);
+    if (boundary.isEmpty())
+        return false;
+
+    connection->multipart->delimiter = "--" + boundary;
+    return true;
+}
+
+void FastDownloaderPrivate::fallBackFromMultipart(FastDownloaderPrivate::Connection* connection)
+{
+    if (!multipartRefused)
+        qWarning("FastDownloader: Multipart requests are not supported by the server, falling back to single ranges");
+    multipartRefused = true;
+
+    if (hasher)
+        QMetaObject::invokeMethod(hasher, "finishChunk", Qt::QueuedConnection, Q_ARG(int, connection->id));
+
+    for (const Portion& part : connection->multipart->parts)
+        insertPortion(part);
+    deleteConnection(connection);
+    fillConnections();
+}
+
+void FastDownloaderPrivate::advance(FastDownloaderPrivate::Connection* connection, qint64 length) const
+{
+    if (length > 0) {
+        connection->pos += length;
+        connection->bandwidth.consume(length);
+        bandwidth.consume(length);
+        QMutexLocker locker(&globalBandwidthMutex);
+        globalBandwidth.consume(length);
+    }
+
+    if (connection->truncated
+            && !connection->dismissed
+            && connection->pos >= connection->bytesTotal) {
+        connection->dismissed = true;
+        // Queued, since we might be in the middle of a signal emitted by the reply
+        QMetaObject::invokeMethod(connection->reply, "abort", Qt::QueuedConnection);
+    }
+}
+
+void FastDownloaderPrivate::scheduleThrottle()
+{
+    if (throttleTimer && !throttleTimer->isActive())
+        throttleTimer->start(THROTTLE_INTERVAL);
+}
+
+void FastDownloaderPrivate::scheduleProgress()
+{
+    Q_Q(const FastDownloader);
+    if (progressTimer && !progressTimer->isActive())
+        progressTimer->start(q->progressInterval());
+}
+
+void FastDownloaderPrivate::flushProgress()
+{
+    if (progressTimer && progressTimer->isActive()) {
+        progressTimer->stop();
+        _q_progress();
+    }
+}
+
+qint64 FastDownloaderPrivate::effectiveMemoryBudget() const
+{
+    Q_Q(const FastDownloader);
+
+    qint64 budget = q->memoryBudget();
+
+    QMutexLocker locker(&globalMemoryMutex);
+    // Shared by the connections still running, finished ones hold no memory of the replies
+    const int count = activeConnectionCount();
+    if (globalMemoryBudget > 0 && globalConnectionCount > 0 && count > 0) {
+        const qint64 share = globalMemoryBudget * qMin(count, globalConnectionCount) / globalConnectionCount;
+        budget = budget > 0 ? qMin(budget, share) : share;
+    }
+    return budget;
+}
+
+qint64 FastDownloaderPrivate::readBufferSizeFor(const FastDownloaderPrivate::Connection* connection) const
+{
+    if (appliedMemoryBudget <= 0)
+        return appliedReadBufferSize;
+
+    int count = 0;
+    qreal drainSpeed = 0;
+    for (const Connection* c : connections) {
+        if (!c->dismissed && c->reply->isRunning()) {
+            ++count;
+            drainSpeed += c->drainSpeed;
+        }
+    }
+
+    // Half of the budget is split evenly, the other half by how fast each connection is read
+    const qint64 half = appliedMemoryBudget / 2;
+    qint64 share = half / qMax(1, count);
+    share += drainSpeed > 0 ? qint64(half * connection->drainSpeed / drainSpeed) : half / qMax(1, count);
+    share = qMax(share, MEMORY_MIN_SHARE);
+    return appliedReadBufferSize > 0 ? qMin(appliedReadBufferSize, share) : share;
+}
+
+void FastDownloaderPrivate::applyReadBufferSize()
+{
+    appliedReadBufferSize = effectiveReadBufferSize();
+    appliedMemoryBudget = effectiveMemoryBudget();
+    for (Connection* connection : connections) {
+        const qint64 size = readBufferSizeFor(connection);
+        if (connection->readBufferSize != size) {
+            connection->readBufferSize = size;
+            connection->reply->setReadBufferSize(size);
+        }
+    }
+}
+
+void FastDownloaderPrivate::finishConnection(FastDownloaderPrivate::Connection* connection)
+{
+    Q_Q(FastDownloader);
+
+    // Ranges a multipart response has left out are requested again one by one
+    if (connection->multipart
+            && !connection->dismissed
+            && !connection->multipart->parts.isEmpty()
+            && connection->reply->error() == QNetworkReply::NoError) {
+        multipartRefused = true;
+        for (const Portion& part : connection->multipart->parts)
+            insertPortion(part);
+        connection->multipart->parts.clear();
+    }
+
+    // A failing hedge leaves the range to its twin, a failing twin takes its hedge along
+    if (connection->twin && !connection->dismissed && connection->reply->error() != QNetworkReply::NoError)
+        dropHedge(connection->hedge ? connection : connection->twin);
+
+    const bool downloadFinished = downloadCompleted();
+    const QNetworkReply::NetworkError error = connection->dismissed
+            ? QNetworkReply::NoError : connection->reply->error();
+
+    // Emitted while the connection is still there, so whatever is left can be read
+    emit q->finished(connection->id);
+
+    if (!running) // Aborted by the user in the meantime
+        return;
+
+    if (hasher)
+        QMetaObject::invokeMethod(hasher, "finishChunk", Qt::QueuedConnection, Q_ARG(int, connection->id));
+
+    if (error != QNetworkReply::NoError) {
+        if (!retryConnection(connection, error)) {
+            this->error = error;
+            q->abort();
+        }
+        return;
+    }
+
+    if (downloadFinished) {
+        if (hasher) {
+            // The final "finished" signal waits for the digest, see _q_hashed
+            journalTimer->stop();
+            monitorTimer->stop();
+            QMetaObject::invokeMethod(hasher, "finish", Qt::QueuedConnection);
+            return;
+        }
+        flushProgress();
+        running = false;
+        free();
+        if (!q->journalFile().isEmpty())
+            QFile::remove(q->journalFile());
+        emit q->finished();
+        return;
+    }
+
+    fillConnections(connection);
+}
+
+void FastDownloaderPrivate::startHashing(bool resuming)
+{
+    Q_Q(FastDownloader);
+
+    hashThread = new QThread;
+    hasher = new FastDownloadHasher(q->hashAlgorithm(), q->outputFile(), q->ranges().isEmpty(),
+                                    q->memoryBudget() > 0 ? q->memoryBudget() : FastDownloader::globalMemoryBudget());
+    hasher->moveToThread(hashThread);
+    QObject::connect(hasher, SIGNAL(chunkHashed(qint64,qint64,QByteArray)),
+                     q, SLOT(_q_chunkHashed(qint64,qint64,QByteArray)));
+    QObject::connect(hasher, SIGNAL(finished(QByteArray)),
+                     q, SLOT(_q_hashed(QByteArray)));
+    hashThread->start();
+
+    // What is not in the remaining portions is in the output file already
+    if (resuming) {
+        qint64 offset = 0;
+        for (const Portion& portion : portions) {
+            if (portion.head > offset) {
+                QMetaObject::invokeMethod(hasher, "addReceived", Qt::QueuedConnection,
+                                          Q_ARG(qint64, offset), Q_ARG(qint64, portion.head - offset));
+            }
+            offset = portion.head + portion.size;
+        }
+        if (contentLength > offset) {
+            QMetaObject::invokeMethod(hasher, "addReceived", Qt::QueuedConnection,
+                                      Q_ARG(qint64, offset), Q_ARG(qint64, contentLength - offset));
+        }
+    }
+}
+
+void FastDownloaderPrivate::stopHashing()
+{
+    if (!hashThread)
+        return;
+
+    // Whatever is still queued for the hasher is dropped along with it
+    hashThread->quit();
+    hashThread->wait();
+    delete hasher;
+    delete hashThread;
+    hasher = nullptr;
+    hashThread = nullptr;
+}
+
+void FastDownloaderPrivate::startWorkers()
+{
+    Q_Q(const FastDownloader);
+
+    for (int i = 0; i < q->workerThreadCount(); ++i) {
+        auto thread = new QThread;
+        auto worker = new FastDownloadWorker(primaryManager()->proxy());
+        worker->moveToThread(thread);
+        thread->start();
+        workerThreads.append(thread);
+        workers.append(worker);
+    }
+}
+
+void FastDownloaderPrivate::stopWorkers()
+{
+    // Replies still running in there are dropped along with their workers
+    for (QThread* thread : workerThreads) {
+        thread->quit();
+        thread->wait();
+    }
+    qDeleteAll(workers);
+    qDeleteAll(workerThreads);
+    workers.clear();
+    workerThreads.clear();
+}
+
+FastDownloadWorker* FastDownloaderPrivate::workerForNextConnection() const
+{
+    FastDownloadWorker* best = nullptr;
+    int bestLoad = 0;
+    for (FastDownloadWorker* worker : workers) {
+        const int load = worker->load();
+        if (!best || load < bestLoad) {
+            best = worker;
+            bestLoad = load;
+        }
+    }
+    return best;
+}
+
+void FastDownloaderPrivate::hash(const FastDownloaderPrivate::Connection* connection, const QByteArray& data) const
+{
+    if (!hasher || data.isEmpty())
+        return;
+
+    QMetaObject::invokeMethod(hasher, "addData", Qt::QueuedConnection, Q_ARG(int, connection->id),
+                              Q_ARG(qint64, connection->head + connection->pos), Q_ARG(QByteArray, data));
+}
+
+void FastDownloaderPrivate::hash(const FastDownloaderPrivate::Connection* connection,
+                                 const char* data, qint64 length) const
+{
+    if (hasher && length > 0)
+        hash(connection, QByteArray(data, int(length)));
+}
+
+void FastDownloaderPrivate::startSimultaneousDownloading(FastDownloaderPrivate::Connection* initial)
+{
+    Q_Q(const FastDownloader);
+
+    if (!running || !resolved || !simultaneousDownloadPossible)
+        return;
+
+    const int count = effectiveConnectionLimit();
+    const qint64 slice = untargetedDataSize() / count;
+
+    for (int i = 0; i < count && nextPortionAvailable(); ++i) {
+        qint64 size = i == count - 1 ? untargetedDataSize() : slice;
+        if (q->chunkSizeLimit() > 0)
+            size = qMin(q->chunkSizeLimit(), size);
+        else if (q->chunkSizeLimit() == FastDownloader::AUTO_CHUNK_SIZE_LIMIT)
+            size = qMin(adaptiveChunkSize(nullptr), size);
+        if (sequentialWindow > 0)
+            size = qMin(size, qMax(qint64(FastDownloader::MIN_CHUNK_SIZE), sequentialWindow / count));
+
+        if (i > 0 && !withinSequentialWindow(nextPortionPosition()))
+            break;
+
+        if (initial && i == 0) {
+            // The resolving reply keeps streaming as the first chunk, it must cover what it has
+            // already received at the very least. Before the priority position, it stops soon
+            // after that, so its slot moves on to the priority position.
+            if (q->priorityPosition() > initial->head)
+                size = qMin(size, qMin(PRIORITY_CHUNK_SIZE, q->priorityPosition() - initial->head));
+            const Portion& portion = takePortionAt(0, qMax(size, qMax(initial->bytesReceived, qint64(1))));
+            Q_ASSERT(portion.head == initial->head);
+            initial->bytesTotal = portion.size;
+            initial->truncated = true;
+            advance(initial, 0);
+        } else {
+            size = qMin(size, priorityChunkSize(nextPortionPosition()));
+            const Portion& portion = takePortion(qMax(size, qint64(1)));
+            createChunkConnection(portion.head, portion.head + portion.size - 1);
+        }
+    }
+}
+
+qint64 FastDownloaderPrivate::adaptiveChunkSize(const FastDownloaderPrivate::Connection* predecessor) const
+{
+    qint64 size = AUTO_PROBE_CHUNK_SIZE;
+
+    // Fast and steady connections get chunks lasting a few seconds (and many
+    // round trips) at their observed speed, so requests cost little in total
+    if (predecessor && predecessor->firstByteTime >= 0 && predecessor->finishTime > predecessor->firstByteTime) {
+        const qint64 transferTime = predecessor->finishTime - predecessor->firstByteTime;
+        const qint64 latency = predecessor->firstByteTime - predecessor->startTime;
+        const qreal speed = predecessor->bytesReceived * 1000.0 / transferTime;
+        const qint64 duration = qMax(AUTO_CHUNK_DURATION, AUTO_CHUNK_LATENCY_FACTOR * latency);
+        size = qMin(qint64(speed * duration / 1000), AUTO_CHUNK_GROWTH * predecessor->bytesTotal);
+    }
+
+    // Near the end nobody takes more than a fair share of what is left, so no
+    // single connection is left behind with a long tail
+    size = qMin(size, untargetedDataSize() / qMax(1, effectiveConnectionLimit()));
+
+    return qMax(qint64(FastDownloader::MIN_CHUNK_SIZE), size);
+}
+
+qint64 FastDownloaderPrivate::nextChunkSize(const FastDownloaderPrivate::Connection* predecessor) const
+{
+    Q_Q(const FastDownloader);
+
+    qint64 size = untargetedDataSize();
+    if (q->chunkSizeLimit() == FastDownloader::AUTO_CHUNK_SIZE_LIMIT)
+        size = qMin(size, adaptiveChunkSize(predecessor));
+    else if (q->chunkSizeLimit() > 0 && size >= 2 * q->chunkSizeLimit())
+        size = q->chunkSizeLimit();
+
+    // Small chunks keep all the connections close to the position being consumed
+    if (sequentialWindow > 0) {
+        const qint64 share = sequentialWindow / qMax(1, effectiveConnectionLimit());
+        size = qMin(size, qMax(qint64(FastDownloader::MIN_CHUNK_SIZE), share));
+    }
+
+    return qMin(size, priorityChunkSize(nextPortionPosition()));
+}
+
+void FastDownloaderPrivate::createNextConnection(const FastDownloaderPrivate::Connection* predecessor)
+{
+    if (multipartPossible()) {
+        const QList<Portion>& parts = takeSmallPortions(nextChunkSize(predecessor));
+        if (parts.size() > 1) {
+            createMultipartConnection(parts);
+            return;
+        }
+        for (const Portion& part : parts)
+            insertPortion(part);
+    }
+
+    const Portion& portion = takePortion(nextChunkSize(predecessor));
+    Connection* connection = createChunkConnection(portion.head, portion.head + portion.size - 1);
+    connection->retries = portion.retries;
+}
+
+void FastDownloaderPrivate::insertPortion(const FastDownloaderPrivate::Portion& portion)
+{
+    int i = 0;
+    while (i < portions.size() && portions.at(i).head < portion.head)
+        ++i;
+    portions.insert(i, portion);
+}
+
+bool FastDownloaderPrivate::retryConnection(FastDownloaderPrivate::Connection* connection,
+                                            QNetworkReply::NetworkError code)
+{
+    Q_Q(const FastDownloader);
+
+    if (!resolved
+            || !simultaneousDownloadPossible
+            || connection->bytesTotal <= 0
+            || connection->retries >= q->maxRetries()
+            || !isTransientError(code)) {
+        return false;
+    }
+
+    // Whatever is not read yet goes away along with the reply
+    const qint64 due = clock.elapsed() + (qint64(q->retryDelay()) << qMin(connection->retries, 16));
+    QList<Portion> pending = pendingPortions(connection);
+    for (Portion& portion : pending) {
+        portion.retries = connection->retries + 1;
+        portion.due = due;
+    }
+    totalBytesReceived -= connection->bytesReceived - connection->pos;
+    bytesWasted += connection->bytesReceived - connection->pos;
+    ++retryCount;
+    dropMirror(connection->mirror, false);
+    deleteConnection(connection);
+
+    if (!pending.isEmpty()) {
+        failedPortions.append(pending);
+        scheduleRetry();
+    }
+
+    return true;
+}
+
+void FastDownloaderPrivate::requeueConnection(FastDownloaderPrivate::Connection* connection)
+{
+    // Nothing of a hedge is counted, and its twin covers its range
+    if (connection->hedge) {
+        deleteConnection(connection);
+        return;
+    }
+
+    if (connection->twin)
+        dropHedge(connection->twin);
+
+    const QList<Portion>& pending = pendingPortions(connection);
+    totalBytesReceived -= connection->bytesReceived - connection->pos;
+    bytesWasted += connection->bytesReceived - connection->pos;
+    deleteConnection(connection);
+
+    for (const Portion& portion : pending)
+        insertPortion(portion);
+}
+
+void FastDownloaderPrivate::replaceStalledConnections()
+{
+    Q_Q(FastDownloader);
+
+    // Ranges can only be handed over to other connections once the download is resolved
+    if (!resolved || !simultaneousDownloadPossible)
+        return;
+
+    const qint64 now = clock.elapsed();
+    bool replaced = false;
+    for (Connection* connection : QList<Connection*>(connections)) {
+        if (connection->dismissed
+                || connection->draining
+                || !connection->reply->isRunning()) {
+            continue;
+        }
+
+        // Data waiting to be read holds the reply back, that's not the network's fault. And the
+        // hedge of a straggler is left to replace it, see settleHedge.
+        if (connection->reply->bytesAvailable() > 0 || (connection->twin && !connection->hedge)) {
+            connection->slowSince = -1;
+            continue;
+        }
+
+        const qint64 lastData = connection->lastDataTime >= 0 ? connection->lastDataTime : connection->startTime;
+        const bool stalled = q->stallTimeout() > 0 && now - lastData >= q->stallTimeout();
+
+        // The speed is measured over the last tick, so only once a connection is that old
+        if (q->lowSpeedLimit() > 0
+                && now - connection->startTime >= MONITOR_INTERVAL
+                && connection->currentSpeed < q->lowSpeedLimit()) {
+            if (connection->slowSince < 0)
+                connection->slowSince = now - MONITOR_INTERVAL;
+        } else {
+            connection->slowSince = -1;
+        }
+        const bool slow = connection->slowSince >= 0 && now - connection->slowSince >= q->lowSpeedTime();
+
+        if (!stalled && !slow)
+            continue;
+
+        qWarning("FastDownloader: Connection %s, its range is handed over to a new one",
+                 stalled ? "stalled" : "too slow");
+        ++stallCount;
+        replaced = true;
+
+        // Its twin covers the range of a hedge, anything else is retried like a failed range,
+        // so a server stalling every connection runs out of retries rather than going on forever
+        if (connection->hedge) {
+            dropMirror(connection->mirror, false);
+            requeueConnection(connection);
+        } else if (!retryConnection(connection, QNetworkReply::TimeoutError)) {
+            error = QNetworkReply::TimeoutError;
+            q->abort();
+            return;
+        }
+    }
+
+    if (replaced)
+        fillConnections();
+}
+
+void FastDownloaderPrivate::probeMirrors()
+{
+    Q_Q(const FastDownloader);
+
+    Mirror primary;
+    primary.url = q->url();
+    primary.resolvedUrl = resolvedUrl;
+    primary.usable = true;
+    mirrors.append(primary);
+
+    if (!simultaneousDownloadPossible)
+        return;
+
+    for (const QUrl& url : q->mirrors()) {
+        QNetworkRequest request;
+        request.setUrl(url);
+        request.setSslConfiguration(q->sslConfiguration());
+        request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+        request.setHeader(QNetworkRequest::UserAgentHeader, "FastDownloader");
+        request.setMaximumRedirectsAllowed(q->maxRedirectsAllowed());
+
+        Mirror mirror;
+        mirror.url = url;
+        mirror.probe = primaryManager()->head(request);
+        QObject::connect(mirror.probe, SIGNAL(finished()), q, SLOT(_q_mirrorProbed()));
+        mirrors.append(mirror);
+    }
+}
+
+bool FastDownloaderPrivate::dropMirror(int index, bool immediately)
+{
+    Mirror& mirror = mirrors[index];
+    if (!mirror.usable)
+        return false;
+
+    if (!immediately && ++mirror.failures < MIRROR_MAX_FAILURES)
+        return false;
+
+    // The last one standing is never dropped
+    int usableCount = 0;
+    for (const Mirror& m : mirrors)
+        usableCount += m.usable;
+    if (usableCount < 2)
+        return false;
+
+    qWarning("FastDownloader: Mirror dropped, %s", qPrintable(mirror.url.toString()));
+    mirror.usable = false;
+    return true;
+}
+
+int FastDownloaderPrivate::mirrorForNextConnection() const
+{
+    QVector<int> load(mirrors.size(), 0);
+    for (Connection* connection : connections) {
+        if (!connection->dismissed && connection->reply->isRunning())
+            ++load[connection->mirror];
+    }
+
+    // Mirrors not measured yet are assumed to be as fast as the average
+    qreal knownSpeed = 0;
+    int knownCount = 0;
+    for (const Mirror& mirror : mirrors) {
+        if (mirror.usable && mirror.transferTime > 0) {
+            knownSpeed += mirror.bytesReceived * 1000.0 / mirror.transferTime;
+            ++knownCount;
+        }
+    }
+    const qreal averageSpeed = knownCount > 0 ? knownSpeed / knownCount : 1;
+
+    int best = 0;
+    qreal bestScore = -1;
+    for (int i = 0; i < mirrors.size(); ++i) {
+        const Mirror& mirror = mirrors.at(i);
+        if (!mirror.usable)
+            continue;
+        const qreal speed = mirror.transferTime > 0
+                ? mirror.bytesReceived * 1000.0 / mirror.transferTime : averageSpeed;
+        const qreal score = speed / (load.at(i) + 1);
+        if (score > bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::createChunkConnection(qint64 begin, qint64 end)
+{
+    const int mirror = mirrors.isEmpty() ? 0 : mirrorForNextConnection();
+    const QUrl& url = mirrors.isEmpty() ? resolvedUrl : mirrors.at(mirror).resolvedUrl;
+    Connection* connection = createConnection(url, begin, end);
+    connection->mirror = mirror;
+    return connection;
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::createMultipartConnection(const QList<FastDownloaderPrivate::Portion>& parts)
+{
+    Q_ASSERT(parts.size() > 1);
+
+    QByteArray range = "bytes=";
+    for (int i = 0; i < parts.size(); ++i) {
+        const Portion& part = parts.at(i);
+        if (i > 0)
+            range.append(',');
+        range.append(QByteArray::number(part.head));
+        range.append('-');
+        range.append(QByteArray::number(part.head + part.size - 1));
+    }
+
+    const int mirror = mirrors.isEmpty() ? 0 : mirrorForNextConnection();
+    const QUrl& url = mirrors.isEmpty() ? resolvedUrl : mirrors.at(mirror).resolvedUrl;
+    Connection* connection = createConnection(url, range);
+    connection->mirror = mirror;
+    connection->head = parts.first().head;
+    connection->multipart = new Multipart;
+    connection->multipart->parts = parts;
+    for (const Portion& part : parts) {
+        connection->bytesTotal += part.size;
+        connection->retries = qMax(connection->retries, part.retries);
+    }
+    return connection;
+}
+
+void FastDownloaderPrivate::scheduleRetry()
+{
+    if (failedPortions.isEmpty())
+        return;
+
+    qint64 due = failedPortions.first().due;
+    for (const Portion& portion : failedPortions)
+        due = qMin(due, portion.due);
+
+    retryTimer->start(int(qBound(qint64(0), due - clock.elapsed(), qint64(std::numeric_limits<int>::max()))));
+}
+
+void FastDownloaderPrivate::fillConnections(const FastDownloaderPrivate::Connection* predecessor)
+{
+    if (!running || !resolved || !simultaneousDownloadPossible)
+        return;
+
+    while (activeConnectionCount() < effectiveConnectionLimit()) {
+        if (nextPortionAvailable()) {
+            // Data far beyond the position being consumed would only pile up
+            if (!withinSequentialWindow(nextPortionPosition()))
+                break;
+            createNextConnection(predecessor);
+        } else if (!splitConnection(connectionToSplit())
+                   && !hedgeConnection(connectionToHedge())) {
+            break;
+        }
+    }
+}
+
+void FastDownloaderPrivate::releaseConnection(FastDownloaderPrivate::Connection* connection)
+{
+    if (connection && connection->hedge) {
+        dropHedge(connection);
+        return;
+    }
+
+    if (!connection || connection->bytesReceived >= connection->bytesTotal)
+        return;
+
+    if (connection->twin)
+        dropHedge(connection->twin);
+
+    // Hand what is not received yet back to the scheduler, and let the
+    // connection go as soon as it delivers what it has received so far
+    Portion portion;
+    portion.head = connection->head + connection->bytesReceived;
+    portion.size = connection->bytesTotal - connection->bytesReceived;
+    portion.retries = connection->retries;
+    connection->bytesTotal = connection->bytesReceived;
+    connection->truncated = true;
+    insertPortion(portion);
+    advance(connection, 0);
+}
+
+void FastDownloaderPrivate::adaptConnectionLimit(qint64 bytes, qint64 elapsed)
+{
+    autoWindowBytes += bytes;
+    autoWindowTime += elapsed;
+    if (++autoWindowTicks < AUTO_WINDOW_TICKS || autoWindowTime <= 0)
+        return;
+
+    const qreal throughput = autoWindowBytes * 1000.0 / autoWindowTime;
+    autoWindowBytes = 0;
+    autoWindowTime = 0;
+    autoWindowTicks = 0;
+
+    if (autoProbing) {
+        autoProbing = false;
+        // Adding a connection didn't pay off, drop it and stay there for a while
+        if (throughput < autoThroughput * 1.1) {
+            --connectionLimit;
+            autoSettle = AUTO_SETTLE_WINDOWS;
+            if (activeConnectionCount() > effectiveConnectionLimit())
+                releaseConnection(connectionToSplit());
+        }
+    } else if (autoSettle > 0) {
+        --autoSettle;
+    } else if (connectionLimit < FastDownloader::MAX_SIMULTANEOUS_CONNECTIONS
+               && connectionLimit < connectionBudget
+               && (nextPortionAvailable() || connectionToSplit())) {
+        ++connectionLimit;
+        autoProbing = true;
+        fillConnections();
+    }
+
+    autoThroughput = throughput;
+}
+
+void FastDownloaderPrivate::countManagerLoad(QHash<QNetworkAccessManager*, int>& load,
+                                             const QString& host) const
+{
+    for (Connection* connection : connections) {
+        if (connection->reply->isRunning() && connection->reply->url().host() == host)
+            ++load[connection->reply->manager()];
+    }
+}
+
+QNetworkAccessManager* FastDownloaderPrivate::managerForNextConnection(const QUrl& url)
+{
+    // QNetworkAccessManager executes up to 6 requests in parallel per host,
+    // so more connections than that are spread over additional managers
+    const int limit = http2Used
+            ? FastDownloader::MAX_HTTP2_STREAMS_PER_MANAGER
+            : FastDownloader::MAX_CONNECTIONS_PER_MANAGER;
+
+    // The managers of a queue are shared by all of its downloads
+    if (queue)
+        return queue->managerForNextConnection(url.host(), limit);
+
+    QList<QNetworkAccessManager*> managers;
+    managers.append(primaryManager());
+    managers.append(extraManagers);
+
+    QHash<QNetworkAccessManager*, int> load;
+    countManagerLoad(load, url.host());
+
+    for (QNetworkAccessManager* candidate : managers) {
+        if (load.value(candidate) < limit)
+            return candidate;
+    }
+
+    QNetworkAccessManager* extraManager = createExtraManager(primaryManager());
+    extraManagers.append(extraManager);
+    return extraManager;
+}
+
+QNetworkAccessManager* FastDownloaderPrivate::createExtraManager(QNetworkAccessManager* primary)
+{
+    auto extraManager = new QNetworkAccessManager;
+    extraManager->setProxy(primary->proxy());
+    extraManager->setRedirectPolicy(primary->redirectPolicy());
+    extraManager->setStrictTransportSecurityEnabled(primary->isStrictTransportSecurityEnabled());
+    extraManager->addStrictTransportSecurityHosts(primary->strictTransportSecurityHosts());
+
+    // The cookie jar and the cache are shared, but they stay owned by the primary manager
+    QNetworkCookieJar* cookieJar = primary->cookieJar();
+    QObject* cookieJarParent = cookieJar->parent();
+    extraManager->setCookieJar(cookieJar);
+    cookieJar->setParent(cookieJarParent);
+
+    if (QAbstractNetworkCache* cache = primary->cache()) {
+        QObject* cacheParent = cache->parent();
+        extraManager->setCache(cache);
+        cache->setParent(cacheParent);
+    }
+
+    // Credentials are asked for wherever the user is listening
+    QObject::connect(extraManager, SIGNAL(authenticationRequired(QNetworkReply*,QAuthenticator*)),
+                     primary, SIGNAL(authenticationRequired(QNetworkReply*,QAuthenticator*)));
+    QObject::connect(extraManager, SIGNAL(proxyAuthenticationRequired(QNetworkProxy,QAuthenticator*)),
+                     primary, SIGNAL(proxyAuthenticationRequired(QNetworkProxy,QAuthenticator*)));
+
+    return extraManager;
+}
+
+void FastDownloaderPrivate::createTimers()
+{
+    Q_Q(FastDownloader);
+
+    if (monitorTimer)
+        return;
+
+    journalTimer = new QTimer(q);
+    QObject::connect(journalTimer, SIGNAL(timeout()), q, SLOT(_q_saveJournal()));
+
+    retryTimer = new QTimer(q);
+    retryTimer->setSingleShot(true);
+    QObject::connect(retryTimer, SIGNAL(timeout()), q, SLOT(_q_retry()));
+
+    monitorTimer = new QTimer(q);
+    QObject::connect(monitorTimer, SIGNAL(timeout()), q, SLOT(_q_monitor()));
+
+    throttleTimer = new QTimer(q);
+    throttleTimer->setSingleShot(true);
+    QObject::connect(throttleTimer, SIGNAL(timeout()), q, SLOT(_q_throttle()));
+
+    progressTimer = new QTimer(q);
+    progressTimer->setSingleShot(true);
+    QObject::connect(progressTimer, SIGNAL(timeout()), q, SLOT(_q_progress()));
+
+    qRegisterMetaType<QList<FastDownloader::ConnectionProgress>>();
+}
+
+bool FastDownloaderPrivate::splitConnection(FastDownloaderPrivate::Connection* connection)
+{
+    if (!connection)
+        return false;
+
+    // Give away the second half of what is left. The reply keeps delivering
+    // data beyond its new end, that part is cut off and the reply is dismissed
+    // once the shrunk range is consumed.
+    const qint64 half = (connection->bytesTotal - connection->bytesReceived) / 2;
+    const qint64 end = connection->head + connection->bytesTotal - 1;
+    connection->bytesTotal -= half;
+    connection->truncated = true;
+
+    createChunkConnection(end - half + 1, end);
+    return true;
+}
+
+bool FastDownloaderPrivate::hedgeConnection(FastDownloaderPrivate::Connection* connection)
+{
+    if (!connection)
+        return false;
+
+    // Request what is not received yet once more, the first copy to get all of it wins
+    const qint64 begin = connection->head + connection->bytesReceived;
+    const qint64 end = connection->head + connection->bytesTotal - 1;
+    Connection* hedge = createChunkConnection(begin, end);
+    hedge->hedge = true;
+    hedge->retries = connection->retries;
+    hedge->twin = connection;
+    connection->twin = hedge;
+    bytesHedged += end - begin + 1;
+    return true;
+}
+
+void FastDownloaderPrivate::settleHedge(FastDownloaderPrivate::Connection* connection)
+{
+    Connection* twin = connection->twin;
+    Q_ASSERT(twin);
+
+    if (!connection->hedge) {
+        dropHedge(twin);
+        return;
+    }
+
+    // The hedge counts for what its twin hasn't received, the twin delivers
+    // what it has received so far and is dismissed
+    const qint64 duplicate = twin->head + twin->bytesReceived - connection->head;
+    totalBytesReceived += connection->bytesTotal - duplicate;
+    bytesWasted += duplicate;
+    connection->hedge = false;
+    connection->twin = nullptr;
+    twin->twin = nullptr;
+    twin->bytesTotal = twin->bytesReceived;
+    twin->truncated = true;
+    advance(twin, 0);
+}
+
+void FastDownloaderPrivate::dropHedge(FastDownloaderPrivate::Connection* connection)
+{
+    Q_ASSERT(connection->hedge);
+
+    if (connection->twin)
+        connection->twin->twin = nullptr;
+    connection->twin = nullptr;
+
+    // Its twin has all of it already, or its range goes back to the scheduler
+    connection->bytesTotal = connection->pos;
+    if (!connection->dismissed) {
+        connection->dismissed = true;
+        // Queued, since we might be in the middle of a signal emitted by the reply
+        QMetaObject::invokeMethod(connection->reply, "abort", Qt::QueuedConnection);
+    }
+}
+
+void FastDownloaderPrivate::deleteConnection(FastDownloaderPrivate::Connection* connection)
+{
+    Q_Q(const FastDownloader);
+    // All of a hedge is wasted, unless it has won (see settleHedge)
+    bytesWasted += connection->hedge
+            ? connection->wireBytes : qMax(qint64(0), connection->wireBytes - connection->bytesReceived);
+    idleTime += connection->idleTime;
+    if (connection->twin)
+        connection->twin->twin = nullptr;
+    uncountConnection(connection);
+    connection->reply->disconnect(q);
+    if (connection->reply->isRunning())
+        connection->reply->abort();
+    connection->reply->deleteLater();
+    connections.removeOne(connection);
+    connectionsById.remove(connection->id);
+    connectionsByReply.remove(connection->reply);
+    delete connection->multipart;
+    delete connection;
+}
+
+void FastDownloaderPrivate::uncountConnection(FastDownloaderPrivate::Connection* connection)
+{
+    if (!connection->counted)
+        return;
+    QMutexLocker locker(&globalMemoryMutex);
+    --globalConnectionCount;
+    connection->counted = false;
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::createConnection(const QUrl& url, qint64 begin, qint64 end)
+{
+    // Without a begin, the end is the length of a suffix, i.e. "bytes=-500" for the last 500 bytes
+    QByteArray range;
+    if (begin >= 0 || end >= 0) {
+        range = "bytes=";
+        if (begin >= 0)
+            range.append(QByteArray::number(begin));
+        range.append('-');
+        range.append(QByteArray::number(end));
+    }
+
+    Connection* connection = createConnection(url, range);
+    if (begin >= 0) {
+        connection->head = begin;
+        connection->bytesTotal = end - begin + 1;
+    }
+    return connection;
+}
+
+FastDownloaderPrivate::Connection* FastDownloaderPrivate::createConnection(const QUrl& url, const QByteArray& range)
+{
+    Q_Q(const FastDownloader);
+
+    const bool isInitial = !resolved;
+
+    QNetworkRequest request;
+    request.setUrl(url);
+    request.setSslConfiguration(q->sslConfiguration());
+    request.setPriority(QNetworkRequest::HighPriority);
+    request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, isInitial);
+    request.setHeader(QNetworkRequest::UserAgentHeader, "FastDownloader");
+    request.setMaximumRedirectsAllowed(isInitial ? q->maxRedirectsAllowed() : 0);
+
+    if (q->isHttp2Enabled()) {
+        request.setAttribute(HTTP2_ALLOWED_ATTRIBUTE, true);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+        QHttp2Configuration http2Configuration;
+        http2Configuration.setStreamReceiveWindowSize(HTTP2_STREAM_WINDOW_SIZE);
+        http2Configuration.setSessionReceiveWindowSize(HTTP2_SESSION_WINDOW_SIZE);
+        http2Configuration.setMaxFrameSize(HTTP2_MAX_FRAME_SIZE);
+        request.setHttp2Configuration(http2Configuration);
+#endif
+    }
+
+    if (!range.isEmpty()) {
+        request.setRawHeader("Range", range);
+        if (!validator().isEmpty())
+            request.setRawHeader("If-Range", validator());
+    }
+
+    QNetworkReply* reply = workers.isEmpty()
+            ? (isInitial ? primaryManager() : managerForNextConnection(url))->get(request)
+            : workerForNextConnection()->get(request);
+
+    ++requestCount;
+
+    auto connection = new Connection;
+    connection->id = generateUniqueId();
+    connection->reply = reply;
+    connection->startTime = clock.elapsed();
+    connection->bandwidth.setRate(q->maxConnectionBandwidth(), q->maxConnectionBandwidthBurst());
+
+    QObject::connect(connection->reply, SIGNAL(finished()),
+                     q, SLOT(_q_finished()));
+    QObject::connect(connection->reply, SIGNAL(readyRead()),
+                     q, SLOT(_q_readyRead()));
+    QObject::connect(connection->reply, SIGNAL(redirected(QUrl)),
+                     q, SLOT(_q_redirected(QUrl)));
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    // The stand-ins of the workers only emit the new signal
+    QObject::connect(connection->reply, SIGNAL(errorOccurred(QNetworkReply::NetworkError)),
+                     q, SLOT(_q_error(QNetworkReply::NetworkError)));
+#else
+    QObject::connect(connection->reply, SIGNAL(error(QNetworkReply::NetworkError)),
+                     q, SLOT(_q_error(QNetworkReply::NetworkError)));
+#endif
+    QObject::connect(connection->reply, SIGNAL(sslErrors(const QList<QSslError>&)),
+                     q, SLOT(_q_sslErrors(const QList<QSslError>&)));
+    QObject::connect(connection->reply, SIGNAL(downloadProgress(qint64,qint64)),
+                     q, SLOT(_q_downloadProgress(qint64,qint64)));
+
+    connections.append(connection);
+    connectionsById.insert(connection->id, connection);
+    connectionsByReply.insert(connection->reply, connection);
+    {
+        QMutexLocker locker(&globalMemoryMutex);
+        ++globalConnectionCount;
+        connection->counted = true;
+    }
+
+    // The shares of the memory budget change with the number of connections
+    applyReadBufferSize();
+    return connection;
+}
+
+void FastDownloaderPrivate::createInitialRangeConnection()
+{
+    Q_Q(const FastDownloader);
+
+    // The lowest head goes first, unless all of them are relative to the end. Then it's the
+    // suffix starting the earliest, the content length (and the head) being unknown yet.
+    const QList<QPair<qint64, qint64>>& ranges = q->ranges();
+    int first = 0;
+    for (int i = 1; i < ranges.size(); ++i) {
+        const qint64 head = ranges.at(i).first;
+        const qint64 firstHead = ranges.at(first).first;
+        if ((head >= 0 && firstHead < 0) || ((head >= 0) == (firstHead >= 0) && head < firstHead))
+            first = i;
+    }
+
+    const QPair<qint64, qint64>& range = ranges.at(first);
+    requestingRanges = true;
+
+    if (range.first >= 0) {
+        createConnection(q->url(), range.first, range.first + range.second - 1);
+    } else {
+        Connection* connection = createConnection(q->url(), -1, -range.first);
+        connection->bytesTotal = range.second;
+        connection->truncated = range.second < -range.first;
+    }
+}
+
+void FastDownloaderPrivate::warmUp(const QUrl& url)
+{
+    Q_Q(const FastDownloader);
+
+    // With HTTP/2 the chunks are multiplexed over the connection of the initial request, and
+    // workers have managers of their own, created as the requests come
+    if (!q->isWarmUpEnabled() || q->isHttp2Enabled() || !workers.isEmpty())
+        return;
+
+    const bool encrypted = url.scheme() == "https";
+    if (!encrypted && url.scheme() != "http")
+        return;
+
+    const quint16 port = quint16(url.port(encrypted ? 443 : 80));
+    const QString& origin = url.scheme() + "://" + url.host() + ':' + QString::number(port);
+    if (url.host().isEmpty() || warmedUpOrigins.contains(origin))
+        return;
+    warmedUpOrigins.insert(origin);
+
+    // The primary manager serves the first chunks, and one of its sockets is already taken by
+    // the request in flight (or will be, once the redirection is followed)
+    const int count = qMin(effectiveConnectionLimit(), int(FastDownloader::MAX_CONNECTIONS_PER_MANAGER)) - 1;
+    for (int i = 0; i < count; ++i) {
+        if (encrypted)
+            primaryManager()->connectToHostEncrypted(url.host(), port, q->sslConfiguration());
+        else
+            primaryManager()->connectToHost(url.host(), port);
+    }
+}
+
+qint64 FastDownloaderPrivate::readLimit(const FastDownloaderPrivate::Connection* connection, qint64 maxSize)
+{
+    if (connection->bytesTotal > 0)
+        return qMax(qint64(0), qMin(maxSize, connection->bytesTotal - connection->pos));
+    return maxSize;
+}
+
+qint64 FastDownloaderPrivate::testContentLength(const FastDownloaderPrivate::Connection* connection)
+{
+    Q_ASSERT(connection && connection->reply);
+    return testContentLength(connection->reply);
+}
+
+qint64 FastDownloaderPrivate::testContentLength(const QNetworkReply* reply)
+{
+    Q_ASSERT(reply);
+    QVariant contentLength = reply->header(QNetworkRequest::ContentLengthHeader);
+    if (contentLength.isNull() || !contentLength.isValid())
+        return -1;
+    return contentLength.toLongLong();
+}
+
+bool FastDownloaderPrivate::testContentRange(const FastDownloaderPrivate::Connection* connection,
+                                             qint64 contentLength)
+{
+    qint64 begin, total;
+    return parseContentRange(connection, &begin, &total)
+            && begin == connection->head
+            && total == contentLength;
+}
+
+bool FastDownloaderPrivate::parseContentRange(const FastDownloaderPrivate::Connection* connection,
+                                              qint64* begin, qint64* total)
+{
+    Q_ASSERT(connection && connection->reply);
+
+    if (connection->reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 206)
+        return false;
+
+    qint64 end;
+    return parseContentRange(connection->reply->rawHeader("Content-Range").trimmed(), begin, &end, total);
+}
+
+bool FastDownloaderPrivate::parseContentRange(const QByteArray& contentRange, qint64* begin, qint64* end, qint64* total)
+{
+    // i.e. "bytes 1024-2047/4096"
+    if (!contentRange.startsWith("bytes "))
+        return false;
+
+    const int dash = contentRange.indexOf('-');
+    const int slash = contentRange.indexOf('/');
+    if (dash < 0 || slash < dash)
+        return false;
+
+    bool ok1, ok2, ok3;
+    *begin = contentRange.mid(6, dash - 6).trimmed().toLongLong(&ok1);
+    *end = contentRange.mid(dash + 1, slash - dash - 1).trimmed().toLongLong(&ok2);
+    *total = contentRange.mid(slash + 1).trimmed().toLongLong(&ok3);
+    return ok1 && ok2 && ok3 && *begin >= 0 && *end >= *begin && *total > *end;
+}
+
+bool FastDownloaderPrivate::containsRange(const QList<FastDownloaderPrivate::Portion>& portions,
+                                          qint64 head, qint64 size)
+{
+    // The portions are sorted by head, and the range may span adjacent ones
+    qint64 pos = head;
+    for (const Portion& portion : portions) {
+        if (portion.head > pos)
+            break;
+        pos = qMax(pos, portion.head + portion.size);
+        if (pos >= head + size)
+            return true;
+    }
+    return false;
+}
+
+void FastDownloaderPrivate::subtractRange(QList<FastDownloaderPrivate::Portion>& portions, qint64 head, qint64 size)
+{
+    const qint64 end = head + size;
+    for (int i = 0; i < portions.size(); ++i) {
+        Portion& portion = portions[i];
+        const qint64 portionEnd = portion.head + portion.size;
+        if (portionEnd <= head || portion.head >= end)
+            continue;
+
+        if (portion.head < head && portionEnd > end) {
+            Portion after(portion);
+            after.head = end;
+            after.size = portionEnd - end;
+            portion.size = head - portion.head;
+            portions.insert(i + 1, after);
+            return;
+        }
+
+        if (portion.head < head) {
+            portion.size = head - portion.head;
+        } else if (portionEnd > end) {
+            portion.size = portionEnd - end;
+            portion.head = end;
+        } else {
+            portions.removeAt(i--);
+        }
+    }
+}
+
+QList<FastDownloaderPrivate::Portion> FastDownloaderPrivate::normalizedRanges(const QList<QPair<qint64, qint64>>& ranges,
+                                                                              qint64 contentLength)
+{
+    QList<Portion> normalized;
+    for (const QPair<qint64, qint64>& range : ranges) {
+        const qint64 head = qMax(qint64(0), range.first < 0 ? contentLength + range.first : range.first);
+        const qint64 end = qMin(contentLength, head + range.second);
+        if (end > head) {
+            Portion portion;
+            portion.head = head;
+            portion.size = end - head;
+            normalized.append(portion);
+        }
+    }
+
+    std::sort(normalized.begin(), normalized.end(), [] (const Portion& a, const Portion& b) {
+        return a.head < b.head;
+    });
+
+    QList<Portion> merged;
+    for (const Portion& portion : normalized) {
+        if (!merged.isEmpty() && merged.last().head + merged.last().size >= portion.head) {
+            Portion& last = merged.last();
+            last.size = qMax(last.head + last.size, portion.head + portion.size) - last.head;
+        } else {
+            merged.append(portion);
+        }
+    }
+    return merged;
+}
+
+bool FastDownloaderPrivate::isTransientError(QNetworkReply::NetworkError code)
+{
+    switch (code) {
+    case QNetworkReply::ConnectionRefusedError:
+    case QNetworkReply::RemoteHostClosedError:
+    case QNetworkReply::TimeoutError:
+    case QNetworkReply::TemporaryNetworkFailureError:
+    case QNetworkReply::NetworkSessionFailedError:
+    case QNetworkReply::ProxyConnectionClosedError:
+    case QNetworkReply::ProxyTimeoutError:
+    case QNetworkReply::InternalServerError:
+    case QNetworkReply::ServiceUnavailableError:
+    case QNetworkReply::UnknownNetworkError:
+    case QNetworkReply::UnknownServerError:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool FastDownloaderPrivate::testSimultaneousDownload(const FastDownloaderPrivate::Connection* connection)
+{
+    Q_ASSERT(connection && connection->reply);
+
+    return connection->reply->hasRawHeader("Accept-Ranges")
+            && connection->reply->hasRawHeader("Content-Length")
+            && connection->reply->rawHeader("Accept-Ranges") == "bytes"
+            && connection->reply->rawHeader("Content-Length").toLongLong() > connection->reply->bytesAvailable()
+            && connection->reply->rawHeader("Content-Length").toLongLong() >= FastDownloader::MIN_SIMULTANEOUS_CONTENT_SIZE;
+}
+
+void FastDownloaderPrivate::_q_finished()
+{
+    Q_Q(FastDownloader);
+
+    Connection* connection = connectionFor(q->sender());
+    connection->finishTime = clock.elapsed();
+    uncountConnection(connection);
+
+    if (connection->mirror < mirrors.size() && connection->firstByteTime >= 0) {
+        Mirror& mirror = mirrors[connection->mirror];
+        mirror.bytesReceived += connection->bytesReceived;
+        mirror.transferTime += connection->finishTime - connection->firstByteTime;
+    }
+
+    // The server has answered with something other than a multipart response
+    if (connection->multipart
+            && connection->multipart->delimiter.isEmpty()
+            && connection->reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).isValid()) {
+        fallBackFromMultipart(connection);
+        return;
+    }
+
+    // Drain what is left in the buffer before the reply is gone
+    if (file || q->sink()) {
+        deliver(connection);
+        if (!running || !connections.contains(connection))
+            return;
+    }
+
+    // Unless the bandwidth limit holds some of it back, then it goes on later
+    if (connection->reply->error() == QNetworkReply::NoError && throttled(connection)) {
+        connection->draining = true;
+        scheduleThrottle();
+        return;
+    }
+
+    finishConnection(connection);
+}
+
+void FastDownloaderPrivate::_q_readyRead()
+{
+    Q_Q(FastDownloader);
+
+    Connection* connection = connectionFor(q->sender());
+    const qint64 now = clock.elapsed();
+    if (connection->firstByteTime < 0)
+        connection->firstByteTime = now;
+    else if (now - connection->lastDataTime > IDLE_THRESHOLD)
+        connection->idleTime += now - connection->lastDataTime;
+    connection->lastDataTime = now;
+
+    // Parts are counted as they are parsed, see writeMultipart
+    if (connection->multipart) {
+        if (connection->multipart->delimiter.isEmpty() && !acceptMultipart(connection)) {
+            fallBackFromMultipart(connection);
+            return;
+        }
+        dispatch(connection);
+        return;
+    }
+
+    const qint64 prevBytesReceived = connection->bytesReceived;
+    connection->bytesReceived = connection->pos + readLimit(connection, connection->reply->bytesAvailable());
+    if (!connection->hedge)
+        totalBytesReceived += connection->bytesReceived - prevBytesReceived;
+
+    if (resolved) {
+        // The resource has changed on the server side if a range is refused (If-Range)
+        if (prevBytesReceived == 0
+                && connection->reply->request().hasRawHeader("Range")
+                && !testContentRange(connection, contentLength)) {
+            // A mirror serving something else is dropped, its range goes to the others
+            if (dropMirror(connection->mirror, true)) {
+                requeueConnection(connection);
+                fillConnections();
+                return;
+            }
+            qWarning("FastDownloader: Range request refused, the resource may have changed");
+            error = QNetworkReply::UnknownContentError;
+            q->abort();
+            return;
+        }
+        if (connection->twin && connection->bytesReceived >= connection->bytesTotal)
+            settleHedge(connection);
+        dispatch(connection);
+    } else {
+        resolved = true;
+        resolvedUrl = connection->reply->url();
+        http2Used = connection->reply->attribute(HTTP2_WAS_USED_ATTRIBUTE).toBool();
+
+        if (requestingRanges) {
+            qint64 begin, total;
+            if (!parseContentRange(connection, &begin, &total)) {
+                qWarning("FastDownloader: Range request refused by the server");
+                error = QNetworkReply::UnknownContentError;
+                q->abort();
+                return;
+            }
+
+            // The head of a suffix is known only now
+            contentLength = total;
+            requestedLength = requestedSize(contentLength);
+            connection->head = begin;
+            connection->bytesTotal = qMin(connection->bytesTotal, contentLength - begin);
+            entityTag = connection->reply->rawHeader("ETag");
+            lastModified = connection->reply->rawHeader("Last-Modified");
+
+            // What the initial connection covers is taken already
+            const qint64 end = connection->head + connection->bytesTotal;
+            for (const Portion& portion : normalizedRanges(q->ranges(), contentLength)) {
+                if (portion.head < connection->head) {
+                    Portion before(portion);
+                    before.size = qMin(portion.head + portion.size, connection->head) - portion.head;
+                    portions.append(before);
+                }
+                if (portion.head + portion.size > end) {
+                    Portion after(portion);
+                    after.head = qMax(portion.head, end);
+                    after.size = portion.head + portion.size - after.head;
+                    portions.append(after);
+                }
+            }
+        } else if (!portions.isEmpty() && !testContentRange(connection, contentLength)) {
+            if (!q->ranges().isEmpty()) {
+                qWarning("FastDownloader: Cannot resume, the resource has changed");
+                error = QNetworkReply::UnknownContentError;
+                q->abort();
+                return;
+            }
+
+            // Cannot resume (i.e. the resource has changed), so this reply
+            // is just an ordinary full download starting from scratch
+            portions.clear();
+            entityTag.clear();
+            lastModified.clear();
+            connection->head = 0;
+            connection->bytesTotal = 0;
+            connection->bytesReceived = connection->reply->bytesAvailable();
+            totalBytesReceived = connection->bytesReceived;
+            if (file)
+                file->resize(0);
+            if (hasher)
+                QMetaObject::invokeMethod(hasher, "reset", Qt::QueuedConnection);
+        }
+
+        if (portions.isEmpty() && !requestingRanges) {
+            contentLength = testContentLength(connection);
+            requestedLength = contentLength;
+            simultaneousDownloadPossible = testSimultaneousDownload(connection);
+            entityTag = connection->reply->rawHeader("ETag");
+            lastModified = connection->reply->rawHeader("Last-Modified");
+        } else {
+            simultaneousDownloadPossible = true;
+        }
+
+        if (file && contentLength > 0 && !file->resize(contentLength)) {
+            qWarning("FastDownloader: Cannot preallocate the output file, %s",
+                     qPrintable(file->errorString()));
+            error = QNetworkReply::UnknownContentError;
+            q->abort();
+            return;
+        }
+
+        emit q->resolved(resolvedUrl);
+
+        if (!running)
+            return;
+
+        probeMirrors();
+        monitorTimer->start(MONITOR_INTERVAL);
+
+        if (requestingRanges) {
+            fillConnections(connection);
+        } else if (!portions.isEmpty()) {
+            startSimultaneousDownloading(connection);
+        } else if (connection->reply->isRunning()
+                   && simultaneousDownloadPossible
+                   && effectiveConnectionLimit() > 1) {
+            Portion portion;
+            portion.size = contentLength;
+            portions.append(portion);
+            startSimultaneousDownloading(connection);
+        } else {
+            connection->bytesTotal = contentLength;
+        }
+
+        if (!q->journalFile().isEmpty() && simultaneousDownloadPossible)
+            journalTimer->start(FastDownloader::JOURNAL_INTERVAL);
+
+        dispatch(connection);
+    }
+}
+
+void FastDownloaderPrivate::_q_saveJournal()
+{
+    saveJournal();
+}
+
+void FastDownloaderPrivate::_q_retry()
+{
+    const qint64 now = clock.elapsed();
+    for (int i = failedPortions.size() - 1; i >= 0; --i) {
+        if (failedPortions.at(i).due <= now)
+            insertPortion(failedPortions.takeAt(i));
+    }
+
+    fillConnections();
+    scheduleRetry();
+}
+
+void FastDownloaderPrivate::_q_monitor()
+{
+    Q_Q(const FastDownloader);
+
+    const qint64 now = clock.elapsed();
+    const qint64 bytes = qMax(qint64(0), totalBytesReceived - sampledBytes);
+    const qint64 elapsed = now - sampledTime;
+    sampledBytes = totalBytesReceived;
+    sampledTime = now;
+
+    if (elapsed > 0) {
+        currentSpeed = bytes * 1000.0 / elapsed;
+        for (Connection* connection : connections) {
+            connection->currentSpeed = (connection->bytesReceived - connection->sampledBytes) * 1000.0 / elapsed;
+            connection->sampledBytes = connection->bytesReceived;
+            connection->drainSpeed = (connection->pos - connection->sampledPos) * 1000.0 / elapsed;
+            connection->sampledPos = connection->pos;
+        }
+    }
+
+    // The global limits may have been changed by someone else, and the shares
+    // of the memory budget follow the connections being read
+    if (effectiveReadBufferSize() != appliedReadBufferSize
+            || appliedMemoryBudget > 0
+            || effectiveMemoryBudget() > 0) {
+        applyReadBufferSize();
+    }
+
+    if (q->numberOfSimultaneousConnections() == FastDownloader::AUTO_SIMULTANEOUS_CONNECTIONS)
+        adaptConnectionLimit(bytes, elapsed);
+
+    replaceStalledConnections();
+
+    // Stragglers become worth hedging as their speed is known
+    if (q->maxHedgedBytes() > 0)
+        fillConnections();
+}
+
+void FastDownloaderPrivate::_q_mirrorProbed()
+{
+    Q_Q(FastDownloader);
+
+    const auto probe = qobject_cast<QNetworkReply*>(q->sender());
+    Q_ASSERT(probe);
+
+    for (Mirror& mirror : mirrors) {
+        if (mirror.probe != probe)
+            continue;
+
+        mirror.probe = nullptr;
+        probe->deleteLater();
+
+        // Must be the very same content, comparing with whatever validator we use
+        const QByteArray& validator = this->validator();
+        const bool sameValidator = validator.isEmpty()
+                || (validator == entityTag && probe->rawHeader("ETag") == entityTag)
+                || (validator == lastModified && probe->rawHeader("Last-Modified") == lastModified);
+
+        mirror.usable = probe->error() == QNetworkReply::NoError
+                && probe->rawHeader("Accept-Ranges") == "bytes"
+                && testContentLength(probe) == contentLength
+                && sameValidator;
+
+        if (mirror.usable)
+            mirror.resolvedUrl = probe->url();
+        else
+            qWarning("FastDownloader: Mirror rejected, %s", qPrintable(mirror.url.toString()));
+        return;
+    }
+}
+
+void FastDownloaderPrivate::_q_throttle()
+{
+    // Take turns on who goes first, so all the connections get their share
+    QList<Connection*> copy(connections);
+    if (!copy.isEmpty()) {
+        throttleTurn = (throttleTurn + 1) % copy.size();
+        std::rotate(copy.begin(), copy.begin() + throttleTurn, copy.end());
+    }
+
+    for (Connection* connection : copy) {
+        if (!running)
+            return;
+        if (!connections.contains(connection))
+            continue;
+
+        if (readLimit(connection, connection->reply->bytesAvailable()) > 0)
+            dispatch(connection);
+
+        if (running
+                && connections.contains(connection)
+                && connection->draining
+                && !throttled(connection)) {
+            connection->draining = false;
+            finishConnection(connection);
+        }
+    }
+}
+
+void FastDownloaderPrivate::_q_progress()
+{
+    Q_Q(FastDownloader);
+
+    QList<FastDownloader::ConnectionProgress> progress;
+    for (Connection* connection : connections) {
+        FastDownloader::ConnectionProgress p;
+        p.id = connection->id;
+        p.head = connection->head;
+        p.bytesReceived = connection->bytesReceived;
+        p.bytesTotal = connection->bytesTotal;
+        p.readyRead = connection->readyReadPending && connection->reply->bytesAvailable() > 0;
+        connection->readyReadPending = false;
+        progress.append(p);
+    }
+
+    emit q->progress(totalBytesReceived, requestedLength, progress);
+}
+
+void FastDownloaderPrivate::_q_chunkHashed(qint64 head, qint64 size, const QByteArray& hash)
+{
+    Q_Q(FastDownloader);
+
+    // Might be a leftover from an aborted download
+    if (q->sender() != hasher)
+        return;
+
+    emit q->chunkHashed(head, size, hash);
+}
+
+void FastDownloaderPrivate::_q_hashed(const QByteArray& digest)
+{
+    Q_Q(FastDownloader);
+
+    if (q->sender() != hasher || !running)
+        return;
+
+    const QByteArray& expected = q->expectedDigest();
+    const bool verified = expected.isEmpty()
+            || (!digest.isEmpty() && (digest == expected || digest.toHex() == expected.toLower()));
+
+    this->digest = digest;
+    flushProgress();
+    running = false;
+    free();
+    if (!q->journalFile().isEmpty())
+        QFile::remove(q->journalFile());
+
+    if (!verified) {
+        qWarning("FastDownloader: Digest mismatch, the content is corrupted");
+        error = QNetworkReply::UnknownContentError;
+        emit q->verificationFailed(digest);
+    }
+
+    emit q->finished();
+}
+
+void FastDownloaderPrivate::_q_redirected(const QUrl& url)
+{
+    Q_Q(FastDownloader);
+
+    if (resolved) {
+        qWarning("WARNING: Suspicious redirection rejected");
+        error = QNetworkReply::InsecureRedirectError;
+        q->abort();
+        return;
+    }
+
+    warmUp(url);
+
+    emit q->redirected(url);
+}
+
+void FastDownloaderPrivate::_q_error(QNetworkReply::NetworkError code)
+{
+    Q_Q(FastDownloader);
+    Connection* connection = connectionFor(q->sender());
+    if (connection->dismissed)
+        return;
+    emit q->error(connection->id, code);
+}
+
+void FastDownloaderPrivate::_q_sslErrors(const QList<QSslError>& errors)
+{
+    Q_Q(FastDownloader);
+    emit q->sslErrors(connectionFor(q->sender())->id, errors);
+}
+
+void FastDownloaderPrivate::_q_downloadProgress(qint64 bytesReceived, qint64 /*bytesTotal*/)
+{
+    Q_Q(FastDownloader);
+    Connection* connection = connectionFor(q->sender());
+    connection->wireBytes = bytesReceived;
+    if (q->progressInterval() > 0) {
+        scheduleProgress();
+        return;
+    }
+    emit q->downloadProgress(connection->id, connection->bytesReceived, connection->bytesTotal);
+    if (connection->reply->error() == QNetworkReply::NoError)
+        emit q->downloadProgress(totalBytesReceived, requestedLength);
+}
+
+FastDownloader::FastDownloader(const QUrl& url, int numberOfSimultaneousConnections, QObject* parent)
+    : QObject(*(new FastDownloaderPrivate), parent)
+    , m_url(url)
+    , m_multipartRequestsEnabled(false)
+    , m_numberOfSimultaneousConnections(numberOfSimultaneousConnections)
+    , m_priorityPosition(-1)
+    , m_maxRedirectsAllowed(5)
+    , m_chunkSizeLimit(0)
+    , m_readBufferSize(0)
+    , m_progressInterval(0)
+    , m_memoryBudget(0)
+    , m_maxHedgedBytes(0)
+    , m_http2Enabled(false)
+    , m_warmUpEnabled(false)
+    , m_workerThreadCount(0)
+    , m_maxBandwidth(0)
+    , m_maxBandwidthBurst(0)
+    , m_maxConnectionBandwidth(0)
+    , m_maxConnectionBandwidthBurst(0)
+    , m_hashingEnabled(false)
+    , m_hashAlgorithm(QCryptographicHash::Sha256)
+    , m_maxRetries(3)
+    , m_retryDelay(1000)
+    , m_stallTimeout(0)
+    , m_lowSpeedLimit(0)
+    , m_lowSpeedTime(0)
+    , m_sink(nullptr)
+    , m_sslConfiguration(QSslConfiguration::defaultConfiguration())
+{
+}
+
+FastDownloader::FastDownloader(QObject* parent) : FastDownloader(QUrl(), 5, parent)
+{
+}
+
+FastDownloader::FastDownloader(FastDownloaderPrivate& dd, QObject* parent)
+    : QObject(dd, parent)
+{
+}
+
+FastDownloader::~FastDownloader()
+{
+    Q_D(FastDownloader);
+    if (d->running) {
+        d->error = QNetworkReply::OperationCanceledError;
+        abort();
+    }
+}
+
+QUrl FastDownloader::url() const
+{
+    return m_url;
+}
+
+void FastDownloader::setUrl(const QUrl& url)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setUrl: Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_url = url;
+}
+
+int FastDownloader::numberOfSimultaneousConnections() const
+{
+    return m_numberOfSimultaneousConnections;
+}
+
+void FastDownloader::setNumberOfSimultaneousConnections(int numberOfSimultaneousConnections)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setNumberOfSimultaneousConnections: "
+                 "Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_numberOfSimultaneousConnections = numberOfSimultaneousConnections;
+}
+
+qint64 FastDownloader::priorityPosition() const
+{
+    return m_priorityPosition;
+}
+
+void FastDownloader::setPriorityPosition(qint64 position)
+{
+    Q_D(FastDownloader);
+
+    m_priorityPosition = qMax(qint64(-1), position);
+
+    if (d->running)
+        d->reprioritize();
+}
+
+int FastDownloader::maxRedirectsAllowed() const
+{
+    return m_maxRedirectsAllowed;
+}
+
+void FastDownloader::setMaxRedirectsAllowed(int maxRedirectsAllowed)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setMaxRedirectsAllowed: "
+                 "Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_maxRedirectsAllowed = maxRedirectsAllowed;
+}
+
+qint64 FastDownloader::chunkSizeLimit() const
+{
+    return m_chunkSizeLimit;
+}
+
+void FastDownloader::setChunkSizeLimit(qint64 chunkSizeLimit)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setChunkSizeLimit: Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_chunkSizeLimit = chunkSizeLimit;
+}
+
+int FastDownloader::progressInterval() const
+{
+    return m_progressInterval;
+}
+
+void FastDownloader::setProgressInterval(int progressInterval)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setProgressInterval: Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_progressInterval = qMax(0, progressInterval);
+}
+
+qint64 FastDownloader::memoryBudget() const
+{
+    return m_memoryBudget;
+}
+
+void FastDownloader::setMemoryBudget(qint64 memoryBudget)
+{
+    Q_D(FastDownloader);
+
+    m_memoryBudget = qMax(qint64(0), memoryBudget);
+
+    if (d->running)
+        d->applyReadBufferSize();
+}
+
+qint64 FastDownloader::globalMemoryBudget()
+{
+    QMutexLocker locker(&FastDownloaderPrivate::globalMemoryMutex);
+    return FastDownloaderPrivate::globalMemoryBudget;
+}
+
+void FastDownloader::setGlobalMemoryBudget(qint64 memoryBudget)
+{
+    QMutexLocker locker(&FastDownloaderPrivate::globalMemoryMutex);
+    FastDownloaderPrivate::globalMemoryBudget = qMax(qint64(0), memoryBudget);
+}
+
+qint64 FastDownloader::readBufferSize() const
+{
+    return m_readBufferSize;
+}
+
+void FastDownloader::setReadBufferSize(qint64 size)
+{
+    Q_D(FastDownloader);
+
+    m_readBufferSize = size;
+
+    if (d->running)
+        d->applyReadBufferSize();
+}
+
+qint64 FastDownloader::maxHedgedBytes() const
+{
+    return m_maxHedgedBytes;
+}
+
+void FastDownloader::setMaxHedgedBytes(qint64 maxHedgedBytes)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setMaxHedgedBytes: Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_maxHedgedBytes = maxHedgedBytes;
+}
+
+bool FastDownloader::isHttp2Enabled() const
+{
+    return m_http2Enabled;
+}
+
+void FastDownloader::setHttp2Enabled(bool http2Enabled)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setHttp2Enabled: Cannot set, a download is already in progress");
+        return;
+    }
+
+    m_http2Enabled = http2Enabled;
 }
 
-void FastDownloaderPrivate::startSimultaneousDownloading()
+bool FastDownloader::isWarmUpEnabled() const
 {
-    Q_Q(const FastDownloader);
+    return m_warmUpEnabled;
+}
 
-    if (!running
-            || !resolved
-            || !simultaneousDownloadPossible
-            || q->numberOfSimultaneousConnections() < 2) {
+void FastDownloader::setWarmUpEnabled(bool warmUpEnabled)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setWarmUpEnabled: Cannot set, a download is already in progress");
         return;
     }
 
-    int i = 0;
-    qint64 begin = 0;
-    qint64 end = -1;
+    m_warmUpEnabled = warmUpEnabled;
+}
 
-    do {
-        begin = end + 1;
+int FastDownloader::workerThreadCount() const
+{
+    return m_workerThreadCount;
+}
 
-        qint64 slice = 0;
-        if (i == q->numberOfSimultaneousConnections() - 1)
-            slice = contentLength - begin;
-        else
-            slice = contentLength / q->numberOfSimultaneousConnections();
+void FastDownloader::setWorkerThreadCount(int workerThreadCount)
+{
+    Q_D(const FastDownloader);
 
-        if (q->chunkSizeLimit() > 0)
-            end = begin + qMin(q->chunkSizeLimit(), slice) - 1;
-        else
-            end = begin + slice - 1;
+    if (d->running) {
+        qWarning("FastDownloader::setWorkerThreadCount: Cannot set, a download is already in progress");
+        return;
+    }
 
-        createConnection(resolvedUrl, begin, end);
-    } while(++i < q->numberOfSimultaneousConnections());
+    m_workerThreadCount = workerThreadCount;
 }
 
-void FastDownloaderPrivate::deleteConnection(FastDownloaderPrivate::Connection* connection)
+qint64 FastDownloader::maxBandwidth() const
 {
-    Q_Q(const FastDownloader);
-    connection->reply->disconnect(q);
-    if (connection->reply->isRunning())
-        connection->reply->abort();
-    connection->reply->deleteLater();
-    connections.removeOne(connection);
-    delete connection;
+    return m_maxBandwidth;
 }
 
-void FastDownloaderPrivate::createConnection(const QUrl& url, qint64 begin, qint64 end)
+qint64 FastDownloader::maxBandwidthBurst() const
 {
-    Q_Q(const FastDownloader);
+    return m_maxBandwidthBurst;
+}
 
-    const bool isInitial = begin < 0;
+void FastDownloader::setMaxBandwidth(qint64 bytesPerSecond, qint64 burst)
+{
+    Q_D(FastDownloader);
 
-    QNetworkRequest request;
-    request.setUrl(url);
-    request.setSslConfiguration(q->sslConfiguration());
-    request.setPriority(QNetworkRequest::HighPriority);
-    request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, isInitial);
-    request.setHeader(QNetworkRequest::UserAgentHeader, "FastDownloader");
-    request.setMaximumRedirectsAllowed(isInitial ? q->maxRedirectsAllowed() : 0);
+    m_maxBandwidth = qMax(qint64(0), bytesPerSecond);
+    m_maxBandwidthBurst = burst;
+    d->bandwidth.setRate(m_maxBandwidth, m_maxBandwidthBurst);
 
-    if (!isInitial) {
-        QByteArray range = "bytes=";
-        range.append(QByteArray::number(begin));
-        range.append('-');
-        range.append(QByteArray::number(end));
-        request.setRawHeader("Range", range);
+    if (d->running) {
+        d->applyReadBufferSize();
+        d->scheduleThrottle(); // Let go of what is held back, if the limit is raised
     }
+}
 
-    QNetworkReply* reply = manager->get(request);
-    reply->setReadBufferSize(q->readBufferSize());
+qint64 FastDownloader::maxConnectionBandwidth() const
+{
+    return m_maxConnectionBandwidth;
+}
 
-    auto connection = new Connection;
-    connection->id = generateUniqueId();
-    connection->reply = reply;
+qint64 FastDownloader::maxConnectionBandwidthBurst() const
+{
+    return m_maxConnectionBandwidthBurst;
+}
 
-    if (!isInitial) {
-        connection->head = begin;
-        connection->bytesTotal = end - begin + 1;
-    }
+void FastDownloader::setMaxConnectionBandwidth(qint64 bytesPerSecond, qint64 burst)
+{
+    Q_D(FastDownloader);
 
-    QObject::connect(connection->reply, SIGNAL(finished()),
-                     q, SLOT(_q_finished()));
-    QObject::connect(connection->reply, SIGNAL(readyRead()),
-                     q, SLOT(_q_readyRead()));
-    QObject::connect(connection->reply, SIGNAL(redirected(QUrl)),
-                     q, SLOT(_q_redirected(QUrl)));
-    QObject::connect(connection->reply, SIGNAL(error(QNetworkReply::NetworkError)),
-                     q, SLOT(_q_error(QNetworkReply::NetworkError)));
-    QObject::connect(connection->reply, SIGNAL(sslErrors(const QList<QSslError>&)),
-                     q, SLOT(_q_sslErrors(const QList<QSslError>&)));
-    QObject::connect(connection->reply, SIGNAL(downloadProgress(qint64,qint64)),
-                     q, SLOT(_q_downloadProgress(qint64,qint64)));
+    m_maxConnectionBandwidth = qMax(qint64(0), bytesPerSecond);
+    m_maxConnectionBandwidthBurst = burst;
 
-    connections.append(connection);
+    if (d->running) {
+        for (FastDownloaderPrivate::Connection* connection : d->connections)
+            connection->bandwidth.setRate(m_maxConnectionBandwidth, m_maxConnectionBandwidthBurst);
+        d->applyReadBufferSize();
+        d->scheduleThrottle();
+    }
 }
 
-qint64 FastDownloaderPrivate::testContentLength(const FastDownloaderPrivate::Connection* connection)
+qint64 FastDownloader::globalMaxBandwidth()
 {
-    Q_ASSERT(connection && connection->reply);
-    QVariant contentLength = connection->reply->header(QNetworkRequest::ContentLengthHeader);
-    if (contentLength.isNull() || !contentLength.isValid())
-        return -1;
-    return contentLength.toLongLong();
+    QMutexLocker locker(&FastDownloaderPrivate::globalBandwidthMutex);
+    return FastDownloaderPrivate::globalBandwidth.rate;
 }
 
-bool FastDownloaderPrivate::testSimultaneousDownload(const FastDownloaderPrivate::Connection* connection)
+void FastDownloader::setGlobalMaxBandwidth(qint64 bytesPerSecond, qint64 burst)
 {
-    Q_ASSERT(connection && connection->reply);
-
-    return connection->reply->hasRawHeader("Accept-Ranges")
-            && connection->reply->hasRawHeader("Content-Length")
-            && connection->reply->rawHeader("Accept-Ranges") == "bytes"
-            && connection->reply->rawHeader("Content-Length").toLongLong() > connection->reply->bytesAvailable()
-            && connection->reply->rawHeader("Content-Length").toLongLong() >= FastDownloader::MIN_SIMULTANEOUS_CONTENT_SIZE;
+    QMutexLocker locker(&FastDownloaderPrivate::globalBandwidthMutex);
+    FastDownloaderPrivate::globalBandwidth.setRate(bytesPerSecond, burst);
 }
 
-void FastDownloaderPrivate::_q_finished()
+bool FastDownloader::isHashingEnabled() const
 {
-    Q_Q(FastDownloader);
+    return m_hashingEnabled;
+}
 
-    Connection* connection = connectionFor(q->sender());
-    const int id = connection->id;
-    const bool downloadFinished = downloadCompleted();
-    const QNetworkReply::NetworkError error = connection->reply->error();
+void FastDownloader::setHashingEnabled(bool hashingEnabled)
+{
+    Q_D(const FastDownloader);
 
-    if (downloadFinished && error == QNetworkReply::NoError) {
-        running = false;
-        free();
+    if (d->running) {
+        qWarning("FastDownloader::setHashingEnabled: Cannot set, a download is already in progress");
+        return;
     }
 
-    emit q->finished(id);
+    m_hashingEnabled = hashingEnabled;
+}
 
-    if (error != QNetworkReply::NoError) {
-        this->error = error;
-        q->abort();
-        return;
-    }
+QCryptographicHash::Algorithm FastDownloader::hashAlgorithm() const
+{
+    return m_hashAlgorithm;
+}
 
-    if (downloadFinished) {
-        emit q->finished();
+void FastDownloader::setHashAlgorithm(QCryptographicHash::Algorithm hashAlgorithm)
+{
+    Q_D(const FastDownloader);
+
+    if (d->running) {
+        qWarning("FastDownloader::setHashAlgorithm: Cannot set, a download is already in progress");
         return;
     }
 
-    qint64 nextPos = nextPortionPosition();
-    if (nextPos > 0) {
-        qint64 nextSize = untargetedDataSize();
-        if (nextSize >= 2 * q->chunkSizeLimit())
-            nextSize = q->chunkSizeLimit();
-        createConnection(resolvedUrl, nextPos, nextPos + nextSize - 1);
-    }
+    m_hashAlgorithm = hashAlgorithm;
 }
 
-void FastDownloaderPrivate::_q_readyRead()
+QByteArray FastDownloader::expectedDigest() const
 {
-    Q_Q(FastDownloader);
-
-    Connection* connection = connectionFor(q->sender());
+    return m_expectedDigest;
+}
 
-    const qint64 prevBytesReceived = connection->bytesReceived;
-    connection->bytesReceived = connection->pos + connection->reply->bytesAvailable();
-    totalBytesReceived += connection->bytesReceived - prevBytesReceived;
+void FastDownloader::setExpectedDigest(const QByteArray& expectedDigest)
+{
+    Q_D(const FastDownloader);
 
-    if (resolved) {
-        emit q->readyRead(connection->id);
-    } else {
-        resolved = true;
-        resolvedUrl = connection->reply->url();
-        contentLength = testContentLength(connection);
-        simultaneousDownloadPossible = testSimultaneousDownload(connection);
+    if (d->running) {
+        qWarning("FastDownloader::setExpectedDigest: Cannot set, a download is already in progress");
+        return;
+    }
 
-        emit q->resolved(resolvedUrl);
+    m_expectedDigest = expectedDigest;
+}
 
-        if (connection->reply->isRunning()
-                && simultaneousDownloadPossible
-                && q->numberOfSimultaneousConnections() > 1) {
-            totalBytesReceived = 0;
-            deleteConnection(connection);
-            startSimultaneousDownloading();
-        } else {
-            connection->bytesTotal = contentLength;
-            emit q->readyRead(connection->id);
-        }
-    }
+QString FastDownloader::outputFile() const
+{
+    return m_outputFile;
 }
 
-void FastDownloaderPrivate::_q_redirected(const QUrl& url)
+void FastDownloader::setOutputFile(const QString& outputFile)
 {
-    Q_Q(FastDownloader);
+    Q_D(const FastDownloader);
 
-    if (resolved) {
-        qWarning("WARNING: Suspicious redirection rejected");
-        error = QNetworkReply::InsecureRedirectError;
-        q->abort();
+    if (d->running) {
+        qWarning("FastDownloader::setOutputFile: Cannot set, a download is already in progress");
         return;
     }
 
-    emit q->redirected(url);
+    m_outputFile = outputFile;
 }
 
-void FastDownloaderPrivate::_q_error(QNetworkReply::NetworkError code)
+int FastDownloader::maxRetries() const
 {
-    Q_Q(FastDownloader);
-    if (code != QNetworkReply::NoError)
-        error = code;
-    emit q->error(connectionFor(q->sender())->id, code);
+    return m_maxRetries;
 }
 
-void FastDownloaderPrivate::_q_sslErrors(const QList<QSslError>& errors)
+void FastDownloader::setMaxRetries(int maxRetries)
 {
-    Q_Q(FastDownloader);
-    emit q->sslErrors(connectionFor(q->sender())->id, errors);
+    m_maxRetries = qMax(0, maxRetries);
 }
 
-void FastDownloaderPrivate::_q_downloadProgress(qint64 /*bytesReceived*/, qint64 /*bytesTotal*/)
+int FastDownloader::retryDelay() const
 {
-    Q_Q(FastDownloader);
-    Connection* connection = connectionFor(q->sender());
-    emit q->downloadProgress(connection->id, connection->bytesReceived, connection->bytesTotal);
-    if (connection->reply->error() == QNetworkReply::NoError)
-        emit q->downloadProgress(totalBytesReceived, contentLength);
+    return m_retryDelay;
 }
 
-FastDownloader::FastDownloader(const QUrl& url, int numberOfSimultaneousConnections, QObject* parent)
-    : QObject(*(new FastDownloaderPrivate), parent)
-    , m_url(url)
-    , m_numberOfSimultaneousConnections(numberOfSimultaneousConnections)
-    , m_maxRedirectsAllowed(5)
-    , m_chunkSizeLimit(0)
-    , m_readBufferSize(0)
-    , m_sslConfiguration(QSslConfiguration::defaultConfiguration())
+void FastDownloader::setRetryDelay(int retryDelay)
 {
+    m_retryDelay = qMax(0, retryDelay);
 }
 
-FastDownloader::FastDownloader(QObject* parent) : FastDownloader(QUrl(), 5, parent)
+int FastDownloader::stallTimeout() const
 {
+    return m_stallTimeout;
 }
 
-FastDownloader::FastDownloader(FastDownloaderPrivate& dd, QObject* parent)
-    : QObject(dd, parent)
+void FastDownloader::setStallTimeout(int stallTimeout)
 {
+    m_stallTimeout = qMax(0, stallTimeout);
 }
 
-FastDownloader::~FastDownloader()
+qint64 FastDownloader::lowSpeedLimit() const
 {
-    Q_D(FastDownloader);
-    if (d->running) {
-        d->error = QNetworkReply::OperationCanceledError;
-        abort();
-    }
+    return m_lowSpeedLimit;
 }
 
-QUrl FastDownloader::url() const
+int FastDownloader::lowSpeedTime() const
 {
-    return m_url;
+    return m_lowSpeedTime;
 }
 
-void FastDownloader::setUrl(const QUrl& url)
+void FastDownloader::setLowSpeedLimit(qint64 bytesPerSecond, int time)
+{
+    m_lowSpeedLimit = qMax(qint64(0), bytesPerSecond);
+    m_lowSpeedTime = qMax(0, time);
+}
+
+QList<QPair<qint64, qint64>> FastDownloader::ranges() const
+{
+    return m_ranges;
+}
+
+void FastDownloader::setRanges(const QList<QPair<qint64, qint64>>& ranges)
 {
     Q_D(const FastDownloader);
 
     if (d->running) {
-        qWarning("FastDownloader::setUrl: Cannot set, a download is already in progress");
+        qWarning("FastDownloader::setRanges: Cannot set, a download is already in progress");
         return;
     }
 
-    m_url = url;
+    m_ranges = ranges;
 }
 
-int FastDownloader::numberOfSimultaneousConnections() const
+bool FastDownloader::isMultipartRequestsEnabled() const
 {
-    return m_numberOfSimultaneousConnections;
+    return m_multipartRequestsEnabled;
 }
 
-void FastDownloader::setNumberOfSimultaneousConnections(int numberOfSimultaneousConnections)
+void FastDownloader::setMultipartRequestsEnabled(bool multipartRequestsEnabled)
 {
     Q_D(const FastDownloader);
 
     if (d->running) {
-        qWarning("FastDownloader::setNumberOfSimultaneousConnections: "
-                 "Cannot set, a download is already in progress");
+        qWarning("FastDownloader::setMultipartRequestsEnabled: Cannot set, a download is already in progress");
         return;
     }
 
-    m_numberOfSimultaneousConnections = numberOfSimultaneousConnections;
+    m_multipartRequestsEnabled = multipartRequestsEnabled;
 }
 
-int FastDownloader::maxRedirectsAllowed() const
+QList<QUrl> FastDownloader::mirrors() const
 {
-    return m_maxRedirectsAllowed;
+    return m_mirrors;
 }
 
-void FastDownloader::setMaxRedirectsAllowed(int maxRedirectsAllowed)
+void FastDownloader::setMirrors(const QList<QUrl>& mirrors)
 {
     Q_D(const FastDownloader);
 
     if (d->running) {
-        qWarning("FastDownloader::setMaxRedirectsAllowed: "
-                 "Cannot set, a download is already in progress");
+        qWarning("FastDownloader::setMirrors: Cannot set, a download is already in progress");
         return;
     }
 
-    m_maxRedirectsAllowed = maxRedirectsAllowed;
+    m_mirrors = mirrors;
 }
 
-qint64 FastDownloader::chunkSizeLimit() const
+QString FastDownloader::journalFile() const
 {
-    return m_chunkSizeLimit;
+    return m_journalFile;
 }
 
-void FastDownloader::setChunkSizeLimit(qint64 chunkSizeLimit)
+void FastDownloader::setJournalFile(const QString& journalFile)
 {
     Q_D(const FastDownloader);
 
     if (d->running) {
-        qWarning("FastDownloader::setChunkSizeLimit: Cannot set, a download is already in progress");
+        qWarning("FastDownloader::setJournalFile: Cannot set, a download is already in progress");
         return;
     }
 
-    m_chunkSizeLimit = chunkSizeLimit;
+    m_journalFile = journalFile;
 }
 
-qint64 FastDownloader::readBufferSize() const
+FastDownloadSink* FastDownloader::sink() const
 {
-    return m_readBufferSize;
+    return m_sink;
 }
 
-void FastDownloader::setReadBufferSize(qint64 size)
+void FastDownloader::setSink(FastDownloadSink* sink)
 {
     Q_D(const FastDownloader);
 
-    m_readBufferSize = size;
-
     if (d->running) {
-        for (FastDownloaderPrivate::Connection* connection : d->connections)
-            connection->reply->setReadBufferSize(m_readBufferSize);
+        qWarning("FastDownloader::setSink: Cannot set, a download is already in progress");
+        return;
     }
+
+    m_sink = sink;
 }
 
 QSslConfiguration FastDownloader::sslConfiguration() const
@@ -517,7 +3161,7 @@ void FastDownloader::setSslConfiguration(const QSslConfiguration& config)
 QNetworkAccessManager* FastDownloader::networkAccessManager() const
 {
     Q_D(const FastDownloader);
-    return d->manager.data();
+    return d->primaryManager();
 }
 
 QUrl FastDownloader::resolvedUrl() const
@@ -574,6 +3218,66 @@ bool FastDownloader::isSimultaneousDownloadPossible() const
     return d->simultaneousDownloadPossible;
 }
 
+FastDownloader::Statistics FastDownloader::statistics() const
+{
+    Q_D(const FastDownloader);
+
+    const qint64 now = d->running ? d->clock.elapsed() : d->stopTime;
+
+    Statistics statistics;
+    statistics.elapsed = now;
+    statistics.bytesReceived = d->totalBytesReceived;
+    statistics.bytesWasted = d->bytesWasted;
+    statistics.currentSpeed = d->running ? d->currentSpeed : 0;
+    statistics.averageSpeed = now > 0 ? d->totalBytesReceived * 1000.0 / now : 0;
+    statistics.idleTime = d->idleTime;
+    statistics.requestCount = d->requestCount;
+    statistics.retryCount = d->retryCount;
+    statistics.stallCount = d->stallCount;
+    statistics.bytesHedged = d->bytesHedged;
+    statistics.connectionLimit = d->effectiveConnectionLimit();
+    statistics.activeConnections = d->activeConnectionCount();
+
+    for (const FastDownloaderPrivate::Connection* connection : d->connections) {
+        const qint64 end = connection->finishTime >= 0 ? connection->finishTime : now;
+        const qint64 lastData = connection->lastDataTime >= 0 ? connection->lastDataTime : end;
+        const bool active = !connection->dismissed && connection->reply->isRunning();
+
+        ConnectionStatistics c;
+        c.id = connection->id;
+        c.url = connection->reply->url();
+        c.head = connection->head;
+        c.bytesTotal = connection->bytesTotal;
+        c.bytesReceived = connection->bytesReceived;
+        c.bytesWasted = connection->hedge
+                ? connection->wireBytes : qMax(qint64(0), connection->wireBytes - connection->bytesReceived);
+        c.currentSpeed = active ? connection->currentSpeed : 0;
+        if (connection->firstByteTime >= 0) {
+            c.timeToFirstByte = connection->firstByteTime - connection->startTime;
+            if (end > connection->firstByteTime)
+                c.averageSpeed = connection->bytesReceived * 1000.0 / (end - connection->firstByteTime);
+        }
+        c.idleTime = connection->idleTime;
+        if (active && now - lastData > IDLE_THRESHOLD)
+            c.idleTime += now - lastData; // Still waiting
+        c.retryCount = connection->retries;
+        c.hedge = connection->hedge;
+        c.running = active;
+
+        statistics.bytesWasted += c.bytesWasted;
+        statistics.idleTime += c.idleTime;
+        statistics.connections.append(c);
+    }
+
+    return statistics;
+}
+
+QByteArray FastDownloader::digest() const
+{
+    Q_D(const FastDownloader);
+    return d->digest;
+}
+
 bool FastDownloader::atEnd(int id) const
 {
     Q_D(const FastDownloader);
@@ -588,7 +3292,10 @@ bool FastDownloader::atEnd(int id) const
         return true;
     }
 
-    return d->connectionFor(id)->reply->atEnd();
+    // Throttled data is still to come, read and bytesAvailable report the throttle instead
+    FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
+    return connection->reply->atEnd()
+            || (connection->bytesTotal > 0 && connection->pos >= connection->bytesTotal);
 }
 
 qint64 FastDownloader::head(int id) const
@@ -639,7 +3346,8 @@ qint64 FastDownloader::bytesAvailable(int id) const
         return -1;
     }
 
-    return d->connectionFor(id)->reply->bytesAvailable();
+    FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
+    return d->readAllowance(connection, connection->reply->bytesAvailable());
 }
 
 qint64 FastDownloader::peek(int id, char* data, qint64 maxSize)
@@ -656,7 +3364,8 @@ qint64 FastDownloader::peek(int id, char* data, qint64 maxSize)
         return -1;
     }
 
-    return d->connectionFor(id)->reply->peek(data, maxSize);
+    FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
+    return connection->reply->peek(data, d->readAllowance(connection, maxSize));
 }
 
 QByteArray FastDownloader::peek(int id, qint64 maxSize)
@@ -673,7 +3382,8 @@ QByteArray FastDownloader::peek(int id, qint64 maxSize)
         return {};
     }
 
-    return d->connectionFor(id)->reply->peek(maxSize);
+    FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
+    return connection->reply->peek(d->readAllowance(connection, maxSize));
 }
 
 qint64 FastDownloader::skip(int id, qint64 maxSize) const
@@ -691,9 +3401,15 @@ qint64 FastDownloader::skip(int id, qint64 maxSize) const
     }
 
     FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
-    const qint64 length = connection->reply->skip(maxSize);
-    if (length > 0)
-        connection->pos += length;
+    if (d->hasher) {
+        // Skipped data still has to be hashed
+        const QByteArray& data = connection->reply->read(d->readAllowance(connection, maxSize));
+        d->hash(connection, data);
+        d->advance(connection, data.size());
+        return data.size();
+    }
+    const qint64 length = connection->reply->skip(d->readAllowance(connection, maxSize));
+    d->advance(connection, length);
     return length;
 }
 
@@ -712,9 +3428,9 @@ qint64 FastDownloader::read(int id, char* data, qint64 maxSize) const
     }
 
     FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
-    const qint64 length = connection->reply->read(data, maxSize);
-    if (length > 0)
-        connection->pos += length;
+    const qint64 length = connection->reply->read(data, d->readAllowance(connection, maxSize));
+    d->hash(connection, data, length);
+    d->advance(connection, length);
     return length;
 }
 
@@ -733,9 +3449,9 @@ QByteArray FastDownloader::read(int id, qint64 maxSize) const
     }
 
     FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
-    const QByteArray& data = connection->reply->read(maxSize);
-    if (data.size() > 0)
-        connection->pos += data.size();
+    const QByteArray& data = connection->reply->read(d->readAllowance(connection, maxSize));
+    d->hash(connection, data);
+    d->advance(connection, data.size());
     return data;
 }
 
@@ -754,9 +3470,9 @@ QByteArray FastDownloader::readAll(int id) const
     }
 
     FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
-    const QByteArray& data = connection->reply->readAll();
-    if (data.size() > 0)
-        connection->pos += data.size();
+    const QByteArray& data = connection->reply->read(d->readAllowance(connection, connection->reply->bytesAvailable()));
+    d->hash(connection, data);
+    d->advance(connection, data.size());
     return data;
 }
 
@@ -775,9 +3491,12 @@ qint64 FastDownloader::readLine(int id, char* data, qint64 maxSize) const
     }
 
     FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
-    const qint64 length = connection->reply->readLine(data, maxSize);
-    if (length > 0)
-        connection->pos += length;
+    const qint64 limit = d->readAllowance(connection, maxSize - 1) + 1;
+    if (limit < 2 && maxSize >= 2)
+        return -1; // Nothing left in the range
+    const qint64 length = connection->reply->readLine(data, limit);
+    d->hash(connection, data, length);
+    d->advance(connection, length);
     return length;
 }
 
@@ -796,9 +3515,12 @@ QByteArray FastDownloader::readLine(int id, qint64 maxSize) const
     }
 
     FastDownloaderPrivate::Connection* connection = d->connectionFor(id);
-    const QByteArray& data = connection->reply->readLine(maxSize);
-    if (data.size() > 0)
-        connection->pos += data.size();
+    const qint64 limit = d->readAllowance(connection, maxSize > 0 ? maxSize : connection->reply->bytesAvailable());
+    if (limit < 1)
+        return {}; // Nothing left in the range, or held back by the bandwidth limit
+    const QByteArray& data = connection->reply->readLine(limit);
+    d->hash(connection, data);
+    d->advance(connection, data.size());
     return data;
 }
 
@@ -862,14 +3584,16 @@ bool FastDownloader::start()
         return false;
     }
 
-    if (m_numberOfSimultaneousConnections < 1
+    if (m_numberOfSimultaneousConnections < 0
             || m_numberOfSimultaneousConnections > MAX_SIMULTANEOUS_CONNECTIONS) {
         qWarning("FastDownloader::start: Number of simultaneous connections is incorrect, "
                  "It may exceeds maximum number of simultaneous connections allowed");
         return false;
     }
 
-    if (m_chunkSizeLimit < MIN_CHUNK_SIZE && m_chunkSizeLimit != 0) {
+    if (m_chunkSizeLimit < MIN_CHUNK_SIZE
+            && m_chunkSizeLimit != 0
+            && m_chunkSizeLimit != AUTO_CHUNK_SIZE_LIMIT) {
         qWarning("FastDownloader::start: Chunk size limit is too small.");
         return false;
     }
@@ -879,8 +3603,76 @@ bool FastDownloader::start()
         return false;
     }
 
+    for (const QPair<qint64, qint64>& range : m_ranges) {
+        if (range.second <= 0 || (range.first < 0 && range.second > -range.first)) {
+            qWarning("FastDownloader::start: Ranges are incorrect");
+            return false;
+        }
+    }
+
+    if (!m_ranges.isEmpty() && !m_expectedDigest.isEmpty()) {
+        qWarning("FastDownloader::start: Cannot verify the digest of ranges");
+        return false;
+    }
+
+    if (m_sink && !m_outputFile.isEmpty()) {
+        qWarning("FastDownloader::start: Cannot use a sink along with an output file");
+        return false;
+    }
+
+    if (m_maxHedgedBytes < 0) {
+        qWarning("FastDownloader::start: Hedged bytes limit is incorrect");
+        return false;
+    }
+
+    if (m_workerThreadCount < 0) {
+        qWarning("FastDownloader::start: Number of worker threads is incorrect");
+        return false;
+    }
+
     d->reset();
-    d->createConnection(m_url);
+    d->createTimers();
+    d->connectionLimit = m_numberOfSimultaneousConnections == AUTO_SIMULTANEOUS_CONNECTIONS
+            ? AUTO_INITIAL_CONNECTIONS : m_numberOfSimultaneousConnections;
+
+    bool resuming = false;
+    if (!m_journalFile.isEmpty()) {
+        resuming = d->loadJournal();
+        // Previously downloaded data is gone if the output file is not there anymore
+        if (resuming && !m_outputFile.isEmpty() && QFileInfo(m_outputFile).size() != d->contentLength) {
+            d->reset();
+            resuming = false;
+        }
+    }
+
+    if (!m_outputFile.isEmpty()) {
+        const QIODevice::OpenMode mode = resuming ? QIODevice::ReadWrite : QIODevice::WriteOnly;
+        d->file.reset(new QFile(m_outputFile));
+        if (!d->file->open(mode | QIODevice::Unbuffered)) {
+            qWarning("FastDownloader::start: Cannot open the output file, %s",
+                     qPrintable(d->file->errorString()));
+            d->file.reset();
+            d->reset();
+            d->running = false;
+            return false;
+        }
+    }
+
+    d->startWorkers();
+
+    if (m_hashingEnabled || !m_expectedDigest.isEmpty())
+        d->startHashing(resuming);
+
+    if (resuming) {
+        const FastDownloaderPrivate::Portion& first = d->portions.first();
+        d->createConnection(m_url, first.head, first.head + first.size - 1);
+    } else if (!m_ranges.isEmpty()) {
+        d->createInitialRangeConnection();
+    } else {
+        d->createConnection(m_url);
+    }
+
+    d->warmUp(m_url);
 
     return true;
 }
@@ -896,6 +3688,7 @@ void FastDownloader::abort()
 
     const QList<FastDownloaderPrivate::Connection>& fakeConnections = d->createFakeCopyForActiveConnections();
 
+    d->saveJournal();
     d->running = false;
     d->free();
 
@@ -904,7 +3697,7 @@ void FastDownloader::abort()
         emit downloadProgress(fakeConnection.id, fakeConnection.bytesReceived, fakeConnection.bytesTotal);
         emit finished(fakeConnection.id);
     }
-    emit downloadProgress(d->totalBytesReceived, d->contentLength);
+    emit downloadProgress(d->totalBytesReceived, d->requestedLength);
     emit finished();
 }
 
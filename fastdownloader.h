@@ -28,6 +28,9 @@
 #include <QUrl>
 #include <QSslError>
 #include <QNetworkReply>
+#include <QCryptographicHash>
+
+class FastDownloadSink;
 
 /*!
     Some notes:
@@ -43,9 +46,155 @@
     QNetworkReply's internal codes if you want to understand more about buffer cleansing)
 
     Also, all the internal connections and QNetworkReply instances are cleared, with all their
-    buffers and data, right before the final "finished" signal is emitted on the last ongoing chunk.
+    buffers and data, right after the "finished" signal of the last ongoing chunk (you can still
+    read what is left of it there) and before the final "finished" signal is emitted.
     Same goes for abort function and any error state. You won't be able to read any data after
     calling abort, or any "error" signal is being emitted.
+
+    When a connection finishes and there is no untouched data left to hand out, the largest
+    ongoing chunk is split in half and its second half is given to a new connection, so all the
+    connections stay busy until the last byte. Hence the size of a chunk may shrink while it is
+    being downloaded; the read functions never return data beyond its (new) end.
+
+    If a chunk fails with a transient error (i.e. the remote host closed the connection, or a 5xx
+    server error), its remaining part (head + pos to the end) is requested again on a new
+    connection after a delay, while other connections keep going. The delay starts with
+    "retryDelay" milliseconds and doubles on each further failure of the same range, up to
+    "maxRetries" times. The "error" signal is still emitted for the failed connection, but the
+    download fails only when a range runs out of retries or the error is not transient. So check
+    "isError" once the final "finished" signal is emitted. Whatever you haven't read from a
+    failed connection before its "finished" signal returns is requested again.
+
+    Mirrors are additional urls serving the very same content. Once the download is resolved,
+    each mirror is checked (same content length and entity tag or modification date, and range
+    support) and then chunks are spread over the url and the valid mirrors, weighted by the speed
+    measured on each. A mirror that keeps failing, or starts serving something else, is dropped.
+    Note that the "head" of a chunk is an offset within the content, regardless of its mirror.
+
+    If an output file is set, incoming data is written straight into that file at the right
+    offset (head + pos) as soon as it arrives, and the file is preallocated to the content
+    length once it is resolved. In that mode the "readyRead" signal is not emitted, since there
+    is nothing left to read; you only have to wait for the final "finished" signal.
+
+    If a journal file is set, the state of the download (the resolved url, the entity tag or
+    the last modification date, the content length and the data ranges that are not received
+    yet) is saved into it periodically and whenever the download is aborted or fails. Calling
+    "start" again resumes the download from where it left off, as long as the server confirms
+    that the resource has not changed (If-Range). The journal is removed once the download is
+    completed successfully. Note that the data received before is not delivered again, so
+    either use an output file along with the journal or keep the data you've read already.
+
+    Bandwidth limits (per download, per connection and for the whole process) are token buckets
+    refilled at the given rate and holding up to "burst" bytes. Nothing is dropped: the read
+    functions (and writes into the output file) never hand out more than the buckets allow, the
+    rest waits in the reply's buffer, which is bounded while a limit is set (a quarter of a
+    second's worth, or the read buffer size if smaller). Once that buffer is full, the reply stops
+    reading from the socket and TCP slows the server down. Held back data is delivered later with
+    another "readyRead" signal, and a finished connection is let go only after it is delivered.
+    Limits can be changed at any time, even while a download is in progress.
+
+    If ranges are set, only those parts of the content are downloaded. One of them is requested
+    first to resolve the download, then the rest are spread over the connections like the whole
+    content would be (overlapping ranges are merged, and parts beyond the content are dropped).
+    A negative head counts from the end of the content, i.e. {-65536, 65536} is its last 64 Kb.
+    The "head" of a chunk is still an offset within the content, so it always falls inside one
+    of the ranges, and "downloadProgress" reports the total size of the ranges. With an output
+    file, the data is written at the same offsets, the parts in between are left empty.
+
+    With a priority position set, the data from that offset on is downloaded first: the chunks
+    start there, the ones next to it being the smallest (so they arrive soon), growing with the
+    distance from it. Once everything after it is taken, the part before it fills in behind. The
+    position can be changed at any time (i.e. on a seek): a connection that would get there only
+    after a while gives away the rest of its range from there on, and if all the connections are
+    busy, the one farthest from the new position lets go of its range to make room.
+
+    With multipart requests enabled (and an output file set), many small ranges waiting next to
+    each other are asked for with a single request (i.e. "Range: bytes=0-99,500-599"), rather than
+    one request each, and each part of the "multipart/byteranges" response is written at its own
+    offset as it is parsed. Such a connection stands for all of its ranges: its "head" is where
+    the first one begins and it is never split. If the server doesn't answer with a multipart
+    response (or leaves some of the ranges out), its ranges are requested again one by one and
+    multipart requests are not used anymore for that download.
+
+    With a sink set (see FastDownloadSink), the data is handed to it as it arrives, read into a
+    reusable buffer rather than a new QByteArray for each packet, and the "readyRead" signal is
+    not emitted. The read functions have nothing to read then.
+
+    With a progress interval set, the "readyRead" and "downloadProgress" signals are not emitted
+    anymore, as they would be for every packet received. Instead, the "progress" signal is emitted
+    at most once per interval (and only if something has changed), with the overall progress and
+    the state of every connection: the ones flagged with "readyRead" have new data to read. The
+    last update is emitted right before the final "finished" signal. It is meant for many downloads
+    reporting to a busy thread (i.e. the user interface), the signal can be delivered across
+    threads. FastDownloadDevice cannot be used in that mode.
+
+    With a memory budget (or a global one), the data buffered by the replies of a download is
+    bounded, whether you read it or not: each connection gets a share of the budget as the read
+    buffer size of its reply (capped by the read buffer size, if set). Half of the budget is split
+    evenly, the other half goes to the connections by how fast their data is being read, so the
+    ones you are consuming from can run ahead while the others wait with full buffers (the server
+    being slowed down by TCP flow control). The shares are revised every second. A global budget
+    is split among the downloads by the number of connections each one has. Note that a share is
+    never smaller than 16 Kb, so a tiny budget may be exceeded.
+
+    With hedging enabled (and an output file set), the end of the download doesn't wait for the
+    slowest connections. Once all of the data is targeted, idle connections request again what
+    the slowest ones (by the time they would take to finish at their current speed) haven't
+    received yet, until the hedged bytes reach the limit set. The first copy to receive all of
+    its range wins, the other one is dismissed. Both write what they receive into the output
+    file meanwhile, the data being the same, but only the first arrival of each byte counts, the
+    rest is wasted. If the original connection fails, its copy goes along and the range is
+    retried as usual.
+
+    A connection that stops delivering data (for longer than the stall timeout) or delivers it
+    too slowly (under the low speed limit for the low speed time, checked once a second) is
+    replaced once the download is resolved: its reply is aborted and what it hasn't received yet
+    is retried like a failed range (after the retry delay, up to "maxRetries" times, after which
+    the download fails with TimeoutError). A connection holding data you haven't read yet (or the
+    bandwidth limit holds back) is never considered stalled, neither is one whose range is hedged
+    already. Each time, its mirror counts a failure.
+
+    With HTTP/2 enabled, the requests are allowed to use HTTP/2 (over TLS, negotiated with ALPN)
+    with flow control windows sized for bulk transfers. Once the download is resolved over HTTP/2,
+    the chunks become streams multiplexed over a single connection per internal access manager,
+    so there is no handshake for each chunk and the per-host limit of HTTP/1.1 doesn't apply.
+    Servers without HTTP/2 support are talked to over HTTP/1.1 as usual.
+
+    With warm-up enabled, the sockets the chunks are going to need are connected (and their TLS
+    handshakes done) while the initial request is still waiting for its response: to the host of
+    the url as the download starts, and to the target of each redirection as it is followed. So
+    the chunk requests, once the download turns out to be simultaneous, go out on connections that
+    are ready, rather than each one paying for its DNS lookup and handshakes before any data
+    flows. Those sockets are idle (and closed by the access manager after a while) if the download
+    turns out not to be simultaneous, so enable it only for downloads known to be large and served
+    by hosts accepting ranges. No warm-up is done with HTTP/2 (the chunks share the connection of
+    the initial request anyway) or with worker threads.
+
+    With worker threads, the requests are run by access managers living in threads of their own
+    (connections are spread over the threads by their load), so sockets are read, and TLS is
+    decrypted, even while the thread of the downloader is busy. The data is handed over to the
+    thread of the downloader through a buffer (bounded by the read buffer size, if set), everything
+    else (signals, the read functions, writing into the output file) stays there as before. Note
+    that the handshake doesn't wait for the "sslErrors" signal to reach you in that mode, so SSL
+    errors can't be ignored from there; set up the SSL configuration beforehand instead. And the
+    network access manager of FastDownloadQueue (or networkAccessManager) isn't used for the
+    requests, only its proxy is.
+
+    If hashing is enabled (or an expected digest is set), data is hashed on a separate thread as
+    it is delivered (read by you, or written into the output file). Each connection gets its own
+    hash, reported with the "chunkHashed" signal once the connection is over, covering the data
+    it has delivered. The digest of the whole content is computed along, as the contiguous part
+    from the beginning grows; parts arriving ahead of it are read back from the output file once
+    the gap before them is filled. With many connections most of the content arrives ahead, so
+    expect most of the file to be read a second time for hashing. Without an output file, those
+    parts are kept in memory instead, up to 64 MB (or the memory budget, if it is smaller); past
+    that the digest of the whole content is given up (the chunk hashes are still reported), so an
+    expected digest cannot be verified and the download fails. Set an output file to verify large
+    downloads. Once all the data is there, the final "finished" signal waits for the digest. If
+    it doesn't match the expected digest (raw or hex encoded), the "verificationFailed" signal is
+    emitted and the download ends with UnknownContentError. Note that data you skip is still read
+    (for hashing), and that without an output file a resumed download cannot be hashed as a
+    whole, since the data received before is not there.
  */
 
 class FastDownloaderPrivate;
@@ -60,15 +209,92 @@ public:
         // Note: QNetworkAccessManager queues the requests it receives. The number of requests
         // executed in parallel is dependent on the protocol. Currently, for the HTTP protocol
         // on desktop platforms, 6 requests are executed in parallel for one host/port combination.
-        MAX_SIMULTANEOUS_CONNECTIONS = 6,
+        // Connections beyond that are spread over additional internal access managers.
+        MAX_CONNECTIONS_PER_MANAGER = 6,
+
+        // Once HTTP/2 is negotiated (see setHttp2Enabled), the requests to a host are multiplexed as
+        // streams over a single connection per access manager, so a manager takes that many of them
+        // before another one (and another connection) is added.
+        MAX_HTTP2_STREAMS_PER_MANAGER = 12,
+
+        // The maximum number of simultaneous connections allowed.
+        MAX_SIMULTANEOUS_CONNECTIONS = 24,
+
+        // Pass it as the number of simultaneous connections to let the downloader decide. It starts
+        // with a few connections and keeps adding more as long as each one increases the overall
+        // throughput noticeably, and drops the last one added otherwise.
+        AUTO_SIMULTANEOUS_CONNECTIONS = 0,
 
         // The minimum possible chunk size allowed for simultaneous downloads. Lesser sized chunks are
         // not allowed (10 Kb). Zero (0) is allowed for chunk size limit and it means no limit.
         MIN_CHUNK_SIZE = 10240,
 
+        // Pass it as the chunk size limit to let the downloader size each chunk on its own, based
+        // on the observed speed and latency of the connection that asks for it. Connections of
+        // unknown speed get small chunks, fast connections get larger ones, and chunks shrink
+        // again towards the end of the download.
+        AUTO_CHUNK_SIZE_LIMIT = -1,
+
         // The minimum possible content size allowed for simultaneous downloads. Lesser sized data
         // will not be downloaded with simultaneous download feature (2 Mb).
-        MIN_SIMULTANEOUS_CONTENT_SIZE = 2097152
+        MIN_SIMULTANEOUS_CONTENT_SIZE = 2097152,
+
+        // The minimum remaining size of an ongoing chunk for it to be split in half in order to
+        // keep an idle connection busy. Smaller remainders are left to their connection (256 Kb).
+        MIN_SPLIT_SIZE = 262144,
+
+        // The interval (in milliseconds) the download journal is saved at, if a journal file is set.
+        JOURNAL_INTERVAL = 3000
+    };
+
+    /*!
+        Speeds are in bytes per second, times are in milliseconds. The current speed is measured
+        over the last second. Idle time is the total of the gaps longer than half a second that
+        a connection waits for data, time to first byte excluded. Wasted bytes are received but
+        thrown away, i.e. data beyond a shrunk chunk, or unread data of a failed connection.
+    */
+    struct ConnectionStatistics
+    {
+        int id = 0;
+        QUrl url;
+        qint64 head = 0;
+        qint64 bytesTotal = 0;
+        qint64 bytesReceived = 0;
+        qint64 bytesWasted = 0;
+        qreal currentSpeed = 0;
+        qreal averageSpeed = 0;
+        qint64 timeToFirstByte = -1;
+        qint64 idleTime = 0;
+        int retryCount = 0; // Of the range this connection is downloading
+        bool hedge = false; // Requests the end of another connection's range again
+        bool running = false;
+    };
+
+    // Reported by the "progress" signal, see setProgressInterval
+    struct ConnectionProgress
+    {
+        int id = 0;
+        qint64 head = 0;
+        qint64 bytesReceived = 0;
+        qint64 bytesTotal = 0;
+        bool readyRead = false; // Data has arrived since the last update, and is there to read
+    };
+
+    struct Statistics
+    {
+        qint64 elapsed = 0;
+        qint64 bytesReceived = 0;
+        qint64 bytesWasted = 0;
+        qreal currentSpeed = 0;
+        qreal averageSpeed = 0;
+        qint64 idleTime = 0;
+        int requestCount = 0;
+        int retryCount = 0;
+        int stallCount = 0; // Connections replaced for being stalled or too slow
+        qint64 bytesHedged = 0; // Requested twice on purpose, see setMaxHedgedBytes
+        int connectionLimit = 0;
+        int activeConnections = 0;
+        QList<ConnectionStatistics> connections; // Only the ones not cleared yet
     };
 
 public:
@@ -79,9 +305,24 @@ public:
     QUrl url() const;
     void setUrl(const QUrl& url);
 
+    QList<QUrl> mirrors() const;
+    void setMirrors(const QList<QUrl>& mirrors);
+
+    // Head and size of each, a negative head is relative to the end of the content
+    QList<QPair<qint64, qint64>> ranges() const;
+    void setRanges(const QList<QPair<qint64, qint64>>& ranges);
+
+    // Packs small ranges into multipart requests, only used along with an output file
+    bool isMultipartRequestsEnabled() const;
+    void setMultipartRequestsEnabled(bool multipartRequestsEnabled);
+
     int numberOfSimultaneousConnections() const;
     void setNumberOfSimultaneousConnections(int numberOfSimultaneousConnections);
 
+    // Offset of the content wanted first (i.e. where a player is), -1 (the default) for none
+    qint64 priorityPosition() const;
+    void setPriorityPosition(qint64 position);
+
     int maxRedirectsAllowed() const;
     void setMaxRedirectsAllowed(int maxRedirectsAllowed);
 
@@ -91,9 +332,90 @@ public:
     qint64 readBufferSize() const;
     void setReadBufferSize(qint64 size);
 
+    // Milliseconds, zero (the default) emits the signals as things happen, see "progress"
+    int progressInterval() const;
+    void setProgressInterval(int progressInterval);
+
+    // Bytes the replies may buffer altogether, zero (the default) means no limit
+    qint64 memoryBudget() const;
+    void setMemoryBudget(qint64 memoryBudget);
+
+    // Shared by all the downloads in the process, by the number of connections each one has
+    static qint64 globalMemoryBudget();
+    static void setGlobalMemoryBudget(qint64 memoryBudget);
+
+    // Bytes requested twice towards the end at most, zero (the default) disables it
+    qint64 maxHedgedBytes() const;
+    void setMaxHedgedBytes(qint64 maxHedgedBytes);
+
+    // Lets the server multiplex the chunks over one or a few connections, if it supports HTTP/2
+    bool isHttp2Enabled() const;
+    void setHttp2Enabled(bool http2Enabled);
+
+    // Connects to the host ahead of the chunk requests, disabled by default
+    bool isWarmUpEnabled() const;
+    void setWarmUpEnabled(bool warmUpEnabled);
+
+    // Zero runs the requests in the thread of the downloader
+    int workerThreadCount() const;
+    void setWorkerThreadCount(int workerThreadCount);
+
+    // Bytes per second, zero means no limit. A zero burst picks a quarter of a second's worth
+    qint64 maxBandwidth() const;
+    qint64 maxBandwidthBurst() const;
+    void setMaxBandwidth(qint64 bytesPerSecond, qint64 burst = 0);
+
+    qint64 maxConnectionBandwidth() const;
+    qint64 maxConnectionBandwidthBurst() const;
+    void setMaxConnectionBandwidth(qint64 bytesPerSecond, qint64 burst = 0);
+
+    // Shared by all the downloads in the process, on top of their own limits
+    static qint64 globalMaxBandwidth();
+    static void setGlobalMaxBandwidth(qint64 bytesPerSecond, qint64 burst = 0);
+
+    bool isHashingEnabled() const;
+    void setHashingEnabled(bool hashingEnabled);
+
+    QCryptographicHash::Algorithm hashAlgorithm() const;
+    void setHashAlgorithm(QCryptographicHash::Algorithm hashAlgorithm);
+
+    // Implies hashing, the download fails if the digest of the content doesn't match
+    QByteArray expectedDigest() const;
+    void setExpectedDigest(const QByteArray& expectedDigest);
+
+    QString outputFile() const;
+    void setOutputFile(const QString& outputFile);
+
+    int maxRetries() const;
+    void setMaxRetries(int maxRetries);
+
+    int retryDelay() const;
+    void setRetryDelay(int retryDelay);
+
+    // Milliseconds a connection can go without any data, zero (the default) means no limit
+    int stallTimeout() const;
+    void setStallTimeout(int stallTimeout);
+
+    // Bytes per second a connection has to keep up, unless it's under that for less than
+    // the time, in milliseconds (i.e. 30000 for curl's --speed-time 30)
+    qint64 lowSpeedLimit() const;
+    int lowSpeedTime() const;
+    void setLowSpeedLimit(qint64 bytesPerSecond, int time);
+
+    QString journalFile() const;
+    void setJournalFile(const QString& journalFile);
+
+    // Takes the data as it arrives instead of the read functions, see FastDownloadSink
+    FastDownloadSink* sink() const;
+    void setSink(FastDownloadSink* sink);
+
     QSslConfiguration sslConfiguration() const;
     void setSslConfiguration(const QSslConfiguration& config);
 
+    // Additional managers, used for more than MAX_CONNECTIONS_PER_MANAGER connections, take over
+    // the proxy, redirect policy and HSTS settings this one has when they are created, share its
+    // cookie jar and cache, and forward their authentication signals to it. A proxy factory isn't
+    // taken over, and settings changed later on don't reach the managers already created
     QNetworkAccessManager* networkAccessManager() const;
 
     /*!
@@ -111,6 +433,12 @@ public:
     bool isResolved() const;
     bool isSimultaneousDownloadPossible() const;
 
+    // Takes a snapshot, can be called at any time (reflects the last download once it's over)
+    Statistics statistics() const;
+
+    // Digest of the whole content, available once the final "finished" signal is emitted
+    QByteArray digest() const;
+
     /*!
         Following functions should be used between the "resolved"
         and the last "finished" signals are being emitted (both
@@ -156,8 +484,19 @@ signals:
     void sslErrors(int id, const QList<QSslError>& errors);
     void downloadProgress(qint64 bytesReceived, qint64 bytesTotal);
     void downloadProgress(int id, qint64 bytesReceived, qint64 bytesTotal);
+    void progress(qint64 bytesReceived, qint64 bytesTotal, const QList<FastDownloader::ConnectionProgress>& connections);
+    void chunkHashed(qint64 head, qint64 size, const QByteArray& hash);
+    void verificationFailed(const QByteArray& digest);
 
 private:
+    Q_PRIVATE_SLOT(d_func(), void _q_saveJournal())
+    Q_PRIVATE_SLOT(d_func(), void _q_retry())
+    Q_PRIVATE_SLOT(d_func(), void _q_monitor())
+    Q_PRIVATE_SLOT(d_func(), void _q_mirrorProbed())
+    Q_PRIVATE_SLOT(d_func(), void _q_throttle())
+    Q_PRIVATE_SLOT(d_func(), void _q_progress())
+    Q_PRIVATE_SLOT(d_func(), void _q_chunkHashed(qint64, qint64, const QByteArray&))
+    Q_PRIVATE_SLOT(d_func(), void _q_hashed(const QByteArray&))
     Q_PRIVATE_SLOT(d_func(), void _q_finished())
     Q_PRIVATE_SLOT(d_func(), void _q_readyRead())
     Q_PRIVATE_SLOT(d_func(), void _q_redirected(const QUrl&))
@@ -167,11 +506,38 @@ private:
 
 private:
     QUrl m_url;
+    QList<QUrl> m_mirrors;
+    QList<QPair<qint64, qint64>> m_ranges;
+    bool m_multipartRequestsEnabled;
     int m_numberOfSimultaneousConnections;
+    qint64 m_priorityPosition;
     int m_maxRedirectsAllowed;
     qint64 m_chunkSizeLimit;
     qint64 m_readBufferSize;
+    int m_progressInterval;
+    qint64 m_memoryBudget;
+    qint64 m_maxHedgedBytes;
+    bool m_http2Enabled;
+    bool m_warmUpEnabled;
+    int m_workerThreadCount;
+    qint64 m_maxBandwidth;
+    qint64 m_maxBandwidthBurst;
+    qint64 m_maxConnectionBandwidth;
+    qint64 m_maxConnectionBandwidthBurst;
+    bool m_hashingEnabled;
+    QCryptographicHash::Algorithm m_hashAlgorithm;
+    QByteArray m_expectedDigest;
+    int m_maxRetries;
+    int m_retryDelay;
+    int m_stallTimeout;
+    qint64 m_lowSpeedLimit;
+    int m_lowSpeedTime;
+    QString m_outputFile;
+    QString m_journalFile;
+    FastDownloadSink* m_sink;
     QSslConfiguration m_sslConfiguration;
 };
 
+Q_DECLARE_METATYPE(FastDownloader::ConnectionProgress)
+
 #endif // FASTDOWNLOADER_H
\ No newline at end of file
@@ -25,7 +25,18 @@ CONFIG      += c++11
 DEFINES     += FASTDOWNLOADER_INCLUDE_STATIC
 INCLUDEPATH += $$PWD
 
-SOURCES     += $$PWD/fastdownloader.cpp
+SOURCES     += $$PWD/fastdownloader.cpp \
+               $$PWD/fastdownloadqueue.cpp \
+               $$PWD/fastdownloadhasher.cpp \
+               $$PWD/fastdownloaddevice.cpp \
+               $$PWD/fastdownloadworker.cpp
 HEADERS     += $$PWD/fastdownloader.h \
                $$PWD/fastdownloader_p.h \
+               $$PWD/fastdownloadqueue.h \
+               $$PWD/fastdownloadqueue_p.h \
+               $$PWD/fastdownloadhasher_p.h \
+               $$PWD/fastdownloaddevice.h \
+               $$PWD/fastdownloaddevice_p.h \
+               $$PWD/fastdownloadworker_p.h \
+               $$PWD/fastdownloadsink.h \
                $$PWD/fastdownloader_global.h
\ No newline at end of file
@@ -25,11 +25,37 @@
 
 #include "fastdownloader.h"
 #include <private/qobject_p.h>
+#include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QThread>
+#include <QSet>
+#include <QHash>
+
+class FastDownloadHasher;
+class FastDownloadWorker;
+class FastDownloadQueuePrivate;
 
 class FastDownloaderPrivate : public QObjectPrivate
 {
     Q_DECLARE_PUBLIC(FastDownloader)
 
+    struct TokenBucket
+    {
+        qint64 rate = 0; // Bytes per second, zero means no limit
+        qint64 burst = 0;
+        qreal tokens = 0;
+        qint64 refillTime = 0; // See clock, in nanoseconds
+        QElapsedTimer clock;
+
+        void setRate(qint64 rate, qint64 burst);
+        qint64 available();
+        void consume(qint64 length);
+    };
+
+    struct Multipart;
+
     struct Connection
     {
         int id = 0;
@@ -37,42 +63,252 @@ class FastDownloaderPrivate : public QObjectPrivate
         qint64 pos = 0;
         qint64 bytesReceived = 0;
         qint64 bytesTotal = 0;
+        bool truncated = false; // Range shrunk, the reply delivers more than bytesTotal
+        bool dismissed = false; // Aborted on purpose, not an error
+        bool draining = false; // Finished, but the bandwidth limit holds some of its data back
+        bool hedge = false; // Requests the end of its twin's range again, its data is not counted
+        int retries = 0;
+        int mirror = 0;
+        qint64 startTime = 0; // See clock
+        qint64 firstByteTime = -1;
+        qint64 finishTime = -1;
+        qint64 lastDataTime = -1;
+        qint64 slowSince = -1; // Under the low speed limit since then, see clock
+        qint64 idleTime = 0;
+        qint64 wireBytes = 0; // As reported by the reply, including what is cut off
+        qint64 sampledBytes = 0;
+        qreal currentSpeed = 0;
+        qint64 sampledPos = 0;
+        qreal drainSpeed = 0; // Of the data being read (or written into the file)
+        qint64 readBufferSize = -1; // Set on the reply, see applyReadBufferSize
+        bool readyReadPending = false; // Reported by the next progress update
+        bool counted = false; // In globalConnectionCount, until its reply finishes
+        TokenBucket bandwidth;
+        Multipart* multipart = nullptr; // Many ranges at once, only if writing into a file
+        Connection* twin = nullptr; // The other copy of a hedged range, see hedgeConnection
         QNetworkReply* reply = nullptr;
     };
 
+    struct Portion
+    {
+        qint64 head = 0;
+        qint64 size = 0;
+        int retries = 0;
+        qint64 due = 0; // Time to retry, see clock
+    };
+
+    struct Multipart
+    {
+        QList<Portion> parts; // Not received yet, sorted by head
+        QByteArray delimiter; // i.e. "--THIS_STRING_SEPARATES", empty until the response is accepted
+        bool inHeaders = false;
+        bool done = false;
+        qint64 partHead = -1; // Of the part being received, see its Content-Range
+        qint64 partSize = 0;
+        qint64 partPos = 0;
+    };
+
+    struct Mirror
+    {
+        QUrl url;
+        QUrl resolvedUrl;
+        QNetworkReply* probe = nullptr;
+        qint64 bytesReceived = 0; // Of finished connections, along with transferTime
+        qint64 transferTime = 0;
+        int failures = 0;
+        bool usable = false;
+    };
+
 public:
     FastDownloaderPrivate();
+    ~FastDownloaderPrivate() override;
+
+    static FastDownloaderPrivate* get(FastDownloader* q) { return q->d_func(); }
+    static QNetworkAccessManager* createExtraManager(QNetworkAccessManager* primary);
 
     int generateUniqueId() const;
     bool downloadCompleted() const;
     bool connectionExists(int id) const;
     bool nextPortionAvailable() const;
     qint64 nextPortionPosition() const;
+    bool withinSequentialWindow(qint64 position) const;
+    void setSequentialHint(qint64 position, qint64 window);
+    int effectiveConnectionLimit() const;
+    QNetworkAccessManager* primaryManager() const;
+    void setConnectionBudget(int budget);
+    int activeConnectionCount() const;
     qint64 untargetedDataSize() const;
+    int nextPortionIndex() const;
+    Portion takePortion(qint64 maxSize);
+    Portion takePortionAt(int index, qint64 maxSize);
+    qint64 priorityDistance(qint64 position) const;
+    qint64 priorityChunkSize(qint64 position) const;
+    Connection* connectionFarthestFromPriority() const;
+    void reprioritize();
+    QList<Portion> remainingPortions() const;
+    QList<Portion> pendingPortions(const Connection* connection) const;
+    QList<Portion> takeSmallPortions(qint64 maxSize);
+    bool multipartPossible() const;
+    qint64 requestedSize(qint64 contentLength) const;
+    QByteArray validator() const;
+    bool throttled(Connection* connection) const;
+    qint64 readAllowance(Connection* connection, qint64 maxSize) const;
+    qint64 effectiveReadBufferSize() const;
+    qint64 effectiveMemoryBudget() const;
+    qint64 readBufferSizeFor(const Connection* connection) const;
 
     Connection* connectionFor(int id) const;
     Connection* connectionFor(const QObject* sender) const;
     QList<Connection> createFakeCopyForActiveConnections() const;
+    Connection* connectionToSplit() const;
+    Connection* connectionToHedge() const;
 
     void free();
     void reset();
-    void startSimultaneousDownloading();
+    bool loadJournal();
+    void saveJournal() const;
+    void dispatch(Connection* connection);
+    void writeToFile(Connection* connection);
+    void writeToSink(Connection* connection);
+    void deliver(Connection* connection);
+    char* readBuffer();
+    void releaseReadBuffer();
+    void writeMultipart(Connection* connection);
+    bool acceptMultipart(Connection* connection);
+    void fallBackFromMultipart(Connection* connection);
+    void advance(Connection* connection, qint64 length) const;
+    void scheduleThrottle();
+    void scheduleProgress();
+    void flushProgress();
+    void applyReadBufferSize();
+    void finishConnection(Connection* connection);
+    void startHashing(bool resuming);
+    void stopHashing();
+    void startWorkers();
+    void stopWorkers();
+    FastDownloadWorker* workerForNextConnection() const;
+    void hash(const Connection* connection, const QByteArray& data) const;
+    void hash(const Connection* connection, const char* data, qint64 length) const;
+    void startSimultaneousDownloading(Connection* initial = nullptr);
+    qint64 adaptiveChunkSize(const Connection* predecessor) const;
+    qint64 nextChunkSize(const Connection* predecessor) const;
+    void createNextConnection(const Connection* predecessor = nullptr);
+    void insertPortion(const Portion& portion);
+    bool retryConnection(Connection* connection, QNetworkReply::NetworkError code);
+    void scheduleRetry();
+    void requeueConnection(Connection* connection);
+    void replaceStalledConnections();
+    void probeMirrors();
+    bool dropMirror(int index, bool immediately);
+    int mirrorForNextConnection() const;
+    Connection* createChunkConnection(qint64 begin, qint64 end);
+    Connection* createMultipartConnection(const QList<Portion>& parts);
+    void fillConnections(const Connection* predecessor = nullptr);
+    void releaseConnection(Connection* connection);
+    void adaptConnectionLimit(qint64 bytes, qint64 elapsed);
+    void countManagerLoad(QHash<QNetworkAccessManager*, int>& load, const QString& host) const;
+    QNetworkAccessManager* managerForNextConnection(const QUrl& url);
+    void createTimers();
+    bool splitConnection(Connection* connection);
+    bool hedgeConnection(Connection* connection);
+    void settleHedge(Connection* connection);
+    void dropHedge(Connection* connection);
     void deleteConnection(Connection* connection);
-    void createConnection(const QUrl& url, qint64 begin = -1, qint64 end = -1);
+    void uncountConnection(Connection* connection);
+    Connection* createConnection(const QUrl& url, qint64 begin = -1, qint64 end = -1);
+    Connection* createConnection(const QUrl& url, const QByteArray& range);
+    void createInitialRangeConnection();
+    void warmUp(const QUrl& url);
 
+    static qint64 readLimit(const Connection* connection, qint64 maxSize);
     static qint64 testContentLength(const Connection* connection);
+    static qint64 testContentLength(const QNetworkReply* reply);
     static bool testSimultaneousDownload(const Connection* connection);
+    static bool isTransientError(QNetworkReply::NetworkError code);
+    static bool testContentRange(const Connection* connection, qint64 contentLength);
+    static bool parseContentRange(const Connection* connection, qint64* begin, qint64* total);
+    static bool parseContentRange(const QByteArray& contentRange, qint64* begin, qint64* end, qint64* total);
+    static bool containsRange(const QList<Portion>& portions, qint64 head, qint64 size);
+    static void subtractRange(QList<Portion>& portions, qint64 head, qint64 size);
+    static QList<Portion> normalizedRanges(const QList<QPair<qint64, qint64>>& ranges, qint64 contentLength);
+
+    static TokenBucket globalBandwidth; // Shared by all the instances in the process
+    static QMutex globalBandwidthMutex;
+    static QList<QByteArray> readBufferPool; // Shared by all the instances in the process
+    static QMutex readBufferPoolMutex;
+    static qint64 globalMemoryBudget;
+    static int globalConnectionCount; // Running ones of all the instances, guarded by the mutex as well
+    static QMutex globalMemoryMutex;
 
     QScopedPointer<QNetworkAccessManager> manager;
+    QList<QNetworkAccessManager*> extraManagers;
+    FastDownloadQueuePrivate* queue; // Its managers are used instead of ours, if set
+    QScopedPointer<QFile> file;
     bool running;
     bool resolved;
     bool simultaneousDownloadPossible;
+    bool requestingRanges; // Resolved by the initial range request, not a resumed one
+    bool multipartRefused; // The server doesn't answer multipart requests properly
+    bool http2Used; // By the resolving reply, so the managers take more requests each
     QUrl resolvedUrl;
+    QSet<QString> warmedUpOrigins; // i.e. "https://example.com:443"
     qint64 contentLength;
+    qint64 requestedLength; // All of the content, or the sum of the ranges
     qint64 totalBytesReceived;
     QNetworkReply::NetworkError error;
+    QByteArray entityTag;
+    QByteArray lastModified;
     QList<Connection*> connections;
+    QHash<int, Connection*> connectionsById; // For the id based public functions
+    QHash<const QObject*, Connection*> connectionsByReply; // For the signals of the replies
+    QList<Portion> portions; // Untargeted data, sorted by head
+    QList<Portion> failedPortions; // Waiting to be retried
+    QList<Mirror> mirrors; // The first one is the url itself
+    qint64 sequentialPosition; // Set by FastDownloadDevice, see setSequentialHint
+    qint64 sequentialWindow;
+    QElapsedTimer clock;
+    int connectionLimit; // Current number of simultaneous connections
+    int connectionBudget; // Granted by FastDownloadQueue, if any
+    qreal currentSpeed;
+    int requestCount;
+    int retryCount;
+    int stallCount;
+    qint64 bytesHedged;
+    qint64 bytesWasted; // Of deleted connections, same for idleTime
+    qint64 idleTime;
+    qint64 stopTime;
+    mutable TokenBucket bandwidth;
+    QByteArray buffer; // Data is read into it, taken from the pool while running
+    qint64 appliedReadBufferSize;
+    qint64 appliedMemoryBudget;
+    int throttleTurn;
+    qint64 sampledBytes;
+    qint64 sampledTime;
+    qint64 autoWindowBytes;
+    qint64 autoWindowTime;
+    int autoWindowTicks;
+    int autoSettle;
+    bool autoProbing;
+    qreal autoThroughput;
+    QTimer* journalTimer;
+    QTimer* retryTimer;
+    QTimer* monitorTimer;
+    QTimer* throttleTimer;
+    QTimer* progressTimer;
+    QThread* hashThread;
+    FastDownloadHasher* hasher;
+    QByteArray digest;
+    QList<QThread*> workerThreads;
+    QList<FastDownloadWorker*> workers; // Run the requests instead of the managers, if any
 
+    void _q_saveJournal();
+    void _q_retry();
+    void _q_monitor();
+    void _q_mirrorProbed();
+    void _q_throttle();
+    void _q_progress();
+    void _q_chunkHashed(qint64 head, qint64 size, const QByteArray& hash);
+    void _q_hashed(const QByteArray& digest);
     void _q_finished();
     void _q_readyRead();
     void _q_redirected(const QUrl& url);
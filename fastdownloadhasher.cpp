@@ -0,0 +1,195 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include "fastdownloadhasher_p.h"
+#include <QFile>
+
+static const qint64 HASH_READ_SIZE = 1048576; // Read back from the file in blocks of that size
+static const qint64 HASH_MAX_PENDING_MEMORY = 67108864; // Kept in memory without a file, at most
+
+FastDownloadHasher::FastDownloadHasher(QCryptographicHash::Algorithm algorithm, const QString& fileName,
+                                       bool wholeContent, qint64 memoryBudget)
+    : m_algorithm(algorithm)
+    , m_wholeContent(wholeContent)
+    , m_maxPendingMemory(memoryBudget > 0 ? qMin(memoryBudget, HASH_MAX_PENDING_MEMORY) : HASH_MAX_PENDING_MEMORY)
+    , m_file(fileName.isEmpty() ? nullptr : new QFile(fileName, this))
+    , m_digest(algorithm)
+    , m_prefix(0)
+    , m_broken(!wholeContent)
+    , m_pendingMemory(0)
+{
+}
+
+FastDownloadHasher::~FastDownloadHasher()
+{
+    for (const Chunk& chunk : m_chunks)
+        delete chunk.hash;
+}
+
+void FastDownloadHasher::reset()
+{
+    for (const Chunk& chunk : m_chunks)
+        delete chunk.hash;
+    m_chunks.clear();
+    m_pending.clear();
+    m_pendingMemory = 0;
+    m_digest.reset();
+    m_prefix = 0;
+    m_broken = !m_wholeContent;
+}
+
+void FastDownloadHasher::addData(int id, qint64 offset, const QByteArray& data)
+{
+    Chunk& chunk = m_chunks[id];
+    if (!chunk.hash) {
+        chunk.head = offset;
+        chunk.hash = new QCryptographicHash(m_algorithm);
+    }
+    chunk.hash->addData(data);
+    chunk.size += data.size();
+
+    if (m_broken)
+        return;
+
+    if (offset == m_prefix) {
+        m_digest.addData(data);
+        m_prefix += data.size();
+        advancePrefix();
+        return;
+    }
+
+    // Out of order, kept aside (in memory if there is no file to read it back from)
+    Piece piece;
+    piece.size = data.size();
+    if (!m_file) {
+        if (m_pendingMemory + data.size() > m_maxPendingMemory) {
+            qWarning("FastDownloader: Too much data ahead to hash the whole data in memory, "
+                     "only the chunks are hashed (and the data cannot be verified)");
+            m_pending.clear();
+            m_pendingMemory = 0;
+            m_broken = true;
+            return;
+        }
+        piece.data = data;
+    }
+    addPiece(offset, piece);
+}
+
+void FastDownloadHasher::addReceived(qint64 offset, qint64 size)
+{
+    if (m_broken || size <= 0)
+        return;
+
+    if (!m_file) {
+        qWarning("FastDownloader: Cannot hash the data received before resuming without an output file");
+        m_broken = true;
+        return;
+    }
+
+    Piece piece;
+    piece.size = size;
+    addPiece(offset, piece);
+}
+
+void FastDownloadHasher::finishChunk(int id)
+{
+    const Chunk& chunk = m_chunks.take(id);
+    if (!chunk.hash)
+        return;
+
+    emit chunkHashed(chunk.head, chunk.size, chunk.hash->result());
+    delete chunk.hash;
+}
+
+void FastDownloadHasher::finish()
+{
+    if (!m_pending.isEmpty() && !m_broken) {
+        qWarning("FastDownloader: Cannot hash the whole data, some parts are missing");
+        m_broken = true;
+    }
+
+    emit finished(m_broken ? QByteArray() : m_digest.result());
+}
+
+void FastDownloadHasher::addPiece(qint64 offset, const FastDownloadHasher::Piece& piece)
+{
+    // The same part may arrive twice (i.e. hedged requests), the longer piece covers both
+    if (m_pending.contains(offset)) {
+        if (m_pending.value(offset).size >= piece.size)
+            return;
+        m_pendingMemory -= m_pending.value(offset).data.size();
+    }
+    m_pending.insert(offset, piece);
+    m_pendingMemory += piece.data.size();
+    advancePrefix();
+}
+
+void FastDownloadHasher::advancePrefix()
+{
+    while (!m_broken && !m_pending.isEmpty() && m_pending.firstKey() <= m_prefix) {
+        const qint64 offset = m_pending.firstKey();
+        const Piece& piece = m_pending.take(offset);
+        const qint64 end = offset + piece.size;
+        m_pendingMemory -= piece.data.size();
+        if (end <= m_prefix)
+            continue; // Hashed already
+
+        if (piece.data.isEmpty()) {
+            if (!hashFromFile(m_prefix, end - m_prefix)) {
+                m_broken = true;
+                return;
+            }
+        } else {
+            m_digest.addData(piece.data.constData() + (m_prefix - offset), int(end - m_prefix));
+        }
+        m_prefix = end;
+    }
+}
+
+bool FastDownloadHasher::hashFromFile(qint64 offset, qint64 size)
+{
+    Q_ASSERT(m_file);
+
+    if (!m_file->isOpen() && !m_file->open(QIODevice::ReadOnly)) {
+        qWarning("FastDownloader: Cannot read the output file back for hashing, %s",
+                 qPrintable(m_file->errorString()));
+        return false;
+    }
+
+    if (!m_file->seek(offset))
+        return false;
+
+    while (size > 0) {
+        const QByteArray& data = m_file->read(qMin(size, HASH_READ_SIZE));
+        if (data.isEmpty()) {
+            qWarning("FastDownloader: Cannot read the output file back for hashing, %s",
+                     qPrintable(m_file->errorString()));
+            return false;
+        }
+        m_digest.addData(data);
+        size -= data.size();
+    }
+
+    return true;
+}
+
+#include "moc_fastdownloadhasher_p.cpp"
@@ -0,0 +1,86 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADHASHER_P_H
+#define FASTDOWNLOADHASHER_P_H
+
+#include <QObject>
+#include <QHash>
+#include <QMap>
+#include <QCryptographicHash>
+
+class QFile;
+
+// Lives in a thread of its own, fed by FastDownloader with queued calls
+class FastDownloadHasher : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(FastDownloadHasher)
+
+    struct Chunk
+    {
+        qint64 head = 0;
+        qint64 size = 0;
+        QCryptographicHash* hash = nullptr;
+    };
+
+    struct Piece
+    {
+        qint64 size = 0;
+        QByteArray data; // Empty if it is in the file
+    };
+
+public:
+    explicit FastDownloadHasher(QCryptographicHash::Algorithm algorithm, const QString& fileName,
+                                bool wholeContent, qint64 memoryBudget);
+    ~FastDownloadHasher() override;
+
+public slots:
+    void reset();
+    void addData(int id, qint64 offset, const QByteArray& data);
+    void addReceived(qint64 offset, qint64 size);
+    void finishChunk(int id);
+    void finish();
+
+signals:
+    void chunkHashed(qint64 head, qint64 size, const QByteArray& hash);
+    void finished(const QByteArray& digest);
+
+private:
+    void addPiece(qint64 offset, const Piece& piece);
+    void advancePrefix();
+    bool hashFromFile(qint64 offset, qint64 size);
+
+private:
+    const QCryptographicHash::Algorithm m_algorithm;
+    const bool m_wholeContent; // Otherwise there is no digest, just the chunk hashes
+    const qint64 m_maxPendingMemory; // Without a file, the digest is given up past that
+    QFile* m_file;
+    QCryptographicHash m_digest;
+    qint64 m_prefix; // The whole file digest covers [0, prefix)
+    bool m_broken;
+    QHash<int, Chunk> m_chunks;
+    QMap<qint64, Piece> m_pending; // Beyond the prefix, by offset
+    qint64 m_pendingMemory; // Of the pieces kept in memory
+};
+
+#endif // FASTDOWNLOADHASHER_P_H
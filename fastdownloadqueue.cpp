@@ -0,0 +1,316 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include "fastdownloadqueue_p.h"
+#include "fastdownloader_p.h"
+
+#include <QHash>
+#include <limits>
+
+FastDownloadQueuePrivate::FastDownloadQueuePrivate() : QObjectPrivate()
+  , manager(new QNetworkAccessManager)
+{
+}
+
+FastDownloadQueuePrivate::~FastDownloadQueuePrivate()
+{
+    qDeleteAll(extraManagers);
+}
+
+QString FastDownloadQueuePrivate::hostOf(const FastDownloader* downloader)
+{
+    if (downloader->isResolved())
+        return downloader->resolvedUrl().host();
+    return downloader->url().host();
+}
+
+int FastDownloadQueuePrivate::wishOf(const FastDownloader* downloader)
+{
+    if (downloader->numberOfSimultaneousConnections() == FastDownloader::AUTO_SIMULTANEOUS_CONNECTIONS)
+        return FastDownloader::MAX_SIMULTANEOUS_CONNECTIONS;
+    return downloader->numberOfSimultaneousConnections();
+}
+
+void FastDownloadQueuePrivate::insert(QList<Entry>& entries, const Entry& entry)
+{
+    int i = 0;
+    while (i < entries.size() && entries.at(i).priority >= entry.priority)
+        ++i;
+    entries.insert(i, entry);
+}
+
+void FastDownloadQueuePrivate::remove(QList<Entry>& entries, const QObject* downloader)
+{
+    for (int i = 0; i < entries.size(); ++i) {
+        if (entries.at(i).downloader == downloader) {
+            entries.removeAt(i);
+            return;
+        }
+    }
+}
+
+void FastDownloadQueuePrivate::rebalance()
+{
+    Q_Q(FastDownloadQueue);
+
+    int globalFree = q->maxConnections();
+    QHash<QString, int> hostFree;
+    const auto freeFor = [&] (const FastDownloader* downloader) -> int& {
+        const QString& host = hostOf(downloader);
+        if (!hostFree.contains(host))
+            hostFree.insert(host, q->maxConnectionsPerHost());
+        return hostFree[host];
+    };
+
+    // Every running download keeps a connection at the very least
+    for (const Entry& entry : running) {
+        --globalFree;
+        --freeFor(entry.downloader);
+    }
+
+    // Then queued downloads are started by their priority, as long as there is room
+    QList<Entry> starting;
+    for (int i = 0; i < queued.size() && globalFree > 0;) {
+        const Entry entry = queued.at(i);
+        int& free = freeFor(entry.downloader);
+        if (free <= 0) {
+            ++i;
+            continue;
+        }
+        --free;
+        --globalFree;
+        queued.removeAt(i);
+        insert(running, entry);
+        starting.append(entry);
+    }
+
+    // And the rest goes to the running downloads by their priority
+    for (const Entry& entry : running) {
+        int& free = freeFor(entry.downloader);
+        const int extra = qMax(0, qMin(wishOf(entry.downloader) - 1, qMin(free, globalFree)));
+        free -= extra;
+        globalFree -= extra;
+        FastDownloaderPrivate::get(entry.downloader)->setConnectionBudget(1 + extra);
+    }
+
+    bool failed = false;
+    for (const Entry& entry : starting) {
+        FastDownloader* downloader = entry.downloader;
+        FastDownloaderPrivate::get(downloader)->queue = this;
+        QObject::connect(downloader, SIGNAL(finished()), q, SLOT(_q_finished()));
+        if (downloader->start()) {
+            emit q->started(downloader);
+        } else {
+            failed = true;
+            remove(running, downloader);
+            downloader->disconnect(q);
+            FastDownloaderPrivate::get(downloader)->queue = nullptr;
+            FastDownloaderPrivate::get(downloader)->connectionBudget = std::numeric_limits<int>::max();
+            emit q->finished(downloader);
+        }
+    }
+
+    // Whatever the failed ones were granted is up for grabs again
+    if (failed)
+        rebalance();
+}
+
+QNetworkAccessManager* FastDownloadQueuePrivate::managerForNextConnection(const QString& host, int limit)
+{
+    // Requests past the limit of a manager wait in it without receiving anything,
+    // so the load of a manager is counted over all the downloads using it
+    QHash<QNetworkAccessManager*, int> load;
+    for (const Entry& entry : running)
+        FastDownloaderPrivate::get(entry.downloader)->countManagerLoad(load, host);
+
+    QList<QNetworkAccessManager*> managers;
+    managers.append(manager.data());
+    managers.append(extraManagers);
+
+    for (QNetworkAccessManager* candidate : managers) {
+        if (load.value(candidate) < limit)
+            return candidate;
+    }
+
+    QNetworkAccessManager* extraManager = FastDownloaderPrivate::createExtraManager(manager.data());
+    extraManagers.append(extraManager);
+    return extraManager;
+}
+
+void FastDownloadQueuePrivate::_q_finished()
+{
+    Q_Q(FastDownloadQueue);
+
+    const auto downloader = qobject_cast<FastDownloader*>(q->sender());
+    Q_ASSERT(downloader);
+
+    remove(running, downloader);
+    downloader->disconnect(q);
+    FastDownloaderPrivate::get(downloader)->queue = nullptr;
+    FastDownloaderPrivate::get(downloader)->connectionBudget = std::numeric_limits<int>::max();
+
+    emit q->finished(downloader);
+
+    rebalance();
+}
+
+void FastDownloadQueuePrivate::_q_destroyed(QObject* object)
+{
+    remove(queued, object);
+    remove(running, object);
+    rebalance();
+}
+
+FastDownloadQueue::FastDownloadQueue(QObject* parent)
+    : QObject(*(new FastDownloadQueuePrivate), parent)
+    , m_maxConnections(FastDownloader::MAX_SIMULTANEOUS_CONNECTIONS)
+    , m_maxConnectionsPerHost(FastDownloader::MAX_CONNECTIONS_PER_MANAGER)
+{
+}
+
+FastDownloadQueue::FastDownloadQueue(FastDownloadQueuePrivate& dd, QObject* parent)
+    : QObject(dd, parent)
+    , m_maxConnections(FastDownloader::MAX_SIMULTANEOUS_CONNECTIONS)
+    , m_maxConnectionsPerHost(FastDownloader::MAX_CONNECTIONS_PER_MANAGER)
+{
+}
+
+FastDownloadQueue::~FastDownloadQueue()
+{
+    Q_D(FastDownloadQueue);
+
+    // Running downloads use our manager, they cannot outlive it
+    const QList<FastDownloadQueuePrivate::Entry> running(d->running);
+    d->queued.clear();
+    d->running.clear();
+    for (const FastDownloadQueuePrivate::Entry& entry : running) {
+        entry.downloader->disconnect(this);
+        if (entry.downloader->isRunning())
+            entry.downloader->abort();
+        FastDownloaderPrivate::get(entry.downloader)->queue = nullptr;
+        FastDownloaderPrivate::get(entry.downloader)->connectionBudget = std::numeric_limits<int>::max();
+    }
+}
+
+int FastDownloadQueue::maxConnections() const
+{
+    return m_maxConnections;
+}
+
+void FastDownloadQueue::setMaxConnections(int maxConnections)
+{
+    Q_D(FastDownloadQueue);
+
+    if (maxConnections < 1) {
+        qWarning("FastDownloadQueue::setMaxConnections: At least one connection is needed");
+        return;
+    }
+
+    m_maxConnections = maxConnections;
+    d->rebalance();
+}
+
+int FastDownloadQueue::maxConnectionsPerHost() const
+{
+    return m_maxConnectionsPerHost;
+}
+
+void FastDownloadQueue::setMaxConnectionsPerHost(int maxConnectionsPerHost)
+{
+    Q_D(FastDownloadQueue);
+
+    if (maxConnectionsPerHost < 1) {
+        qWarning("FastDownloadQueue::setMaxConnectionsPerHost: At least one connection is needed");
+        return;
+    }
+
+    m_maxConnectionsPerHost = maxConnectionsPerHost;
+    d->rebalance();
+}
+
+QNetworkAccessManager* FastDownloadQueue::networkAccessManager() const
+{
+    Q_D(const FastDownloadQueue);
+    return d->manager.data();
+}
+
+QList<FastDownloader*> FastDownloadQueue::queuedDownloads() const
+{
+    Q_D(const FastDownloadQueue);
+    QList<FastDownloader*> downloads;
+    for (const FastDownloadQueuePrivate::Entry& entry : d->queued)
+        downloads.append(entry.downloader);
+    return downloads;
+}
+
+QList<FastDownloader*> FastDownloadQueue::runningDownloads() const
+{
+    Q_D(const FastDownloadQueue);
+    QList<FastDownloader*> downloads;
+    for (const FastDownloadQueuePrivate::Entry& entry : d->running)
+        downloads.append(entry.downloader);
+    return downloads;
+}
+
+void FastDownloadQueue::enqueue(FastDownloader* downloader, int priority)
+{
+    Q_D(FastDownloadQueue);
+
+    if (!downloader) {
+        qWarning("FastDownloadQueue::enqueue: Downloader is null");
+        return;
+    }
+
+    if (downloader->isRunning()) {
+        qWarning("FastDownloadQueue::enqueue: Cannot enqueue, the download is already in progress");
+        return;
+    }
+
+    if (queuedDownloads().contains(downloader)) {
+        qWarning("FastDownloadQueue::enqueue: The download is already enqueued");
+        return;
+    }
+
+    FastDownloadQueuePrivate::Entry entry;
+    entry.downloader = downloader;
+    entry.priority = priority;
+    d->insert(d->queued, entry);
+
+    connect(downloader, SIGNAL(destroyed(QObject*)), this, SLOT(_q_destroyed(QObject*)));
+
+    d->rebalance();
+}
+
+void FastDownloadQueue::dequeue(FastDownloader* downloader)
+{
+    Q_D(FastDownloadQueue);
+
+    if (!queuedDownloads().contains(downloader)) {
+        qWarning("FastDownloadQueue::dequeue: No such download is waiting in the queue");
+        return;
+    }
+
+    d->remove(d->queued, downloader);
+    downloader->disconnect(this);
+}
+
+#include "moc_fastdownloadqueue.cpp"
@@ -0,0 +1,92 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADQUEUE_H
+#define FASTDOWNLOADQUEUE_H
+
+#include "fastdownloader_global.h"
+
+#include <QObject>
+
+/*!
+    Some notes:
+    A download queue runs many downloads at once without letting them fight over the bandwidth
+    and the host slots. Downloads you enqueue are started in the order of their priority (the
+    higher the sooner, and in the order they are enqueued among equals) as long as the global
+    and the per-host connection limits allow. All of them share the queue's network access manager,
+    and the additional managers the queue creates once a host has MAX_CONNECTIONS_PER_MANAGER
+    requests running on each of the existing ones (see FastDownloader::networkAccessManager).
+
+    Connections are granted to running downloads by their priority, each getting at most its own
+    number of simultaneous connections (or MAX_SIMULTANEOUS_CONNECTIONS if it is set to auto).
+    Whenever a download finishes, the connections it used are handed over to the queued downloads
+    first, and then to the running ones, which split their remaining ranges to make use of them.
+
+    The queue doesn't own the downloads; it starts them and forgets about them once they are
+    finished (or destroyed). Do not start an enqueued download yourself.
+ */
+
+class FastDownloader;
+class QNetworkAccessManager;
+class FastDownloadQueuePrivate;
+class FASTDOWNLOADER_EXPORT FastDownloadQueue : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(FastDownloadQueue)
+    Q_DECLARE_PRIVATE(FastDownloadQueue)
+
+public:
+    explicit FastDownloadQueue(QObject* parent = nullptr);
+    ~FastDownloadQueue() override;
+
+    int maxConnections() const;
+    void setMaxConnections(int maxConnections);
+
+    int maxConnectionsPerHost() const;
+    void setMaxConnectionsPerHost(int maxConnectionsPerHost);
+
+    QNetworkAccessManager* networkAccessManager() const;
+
+    QList<FastDownloader*> queuedDownloads() const;
+    QList<FastDownloader*> runningDownloads() const;
+
+public slots:
+    void enqueue(FastDownloader* downloader, int priority = 0);
+    void dequeue(FastDownloader* downloader);
+
+protected:
+    FastDownloadQueue(FastDownloadQueuePrivate& dd, QObject* parent);
+
+signals:
+    void started(FastDownloader* downloader);
+    void finished(FastDownloader* downloader);
+
+private:
+    Q_PRIVATE_SLOT(d_func(), void _q_finished())
+    Q_PRIVATE_SLOT(d_func(), void _q_destroyed(QObject*))
+
+private:
+    int m_maxConnections;
+    int m_maxConnectionsPerHost;
+};
+
+#endif // FASTDOWNLOADQUEUE_H
@@ -0,0 +1,61 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADQUEUE_P_H
+#define FASTDOWNLOADQUEUE_P_H
+
+#include "fastdownloadqueue.h"
+#include <private/qobject_p.h>
+#include <QNetworkAccessManager>
+
+class FastDownloadQueuePrivate : public QObjectPrivate
+{
+    Q_DECLARE_PUBLIC(FastDownloadQueue)
+
+    struct Entry
+    {
+        FastDownloader* downloader = nullptr;
+        int priority = 0;
+    };
+
+public:
+    FastDownloadQueuePrivate();
+    ~FastDownloadQueuePrivate() override;
+
+    static QString hostOf(const FastDownloader* downloader);
+    static int wishOf(const FastDownloader* downloader);
+
+    void insert(QList<Entry>& entries, const Entry& entry);
+    void remove(QList<Entry>& entries, const QObject* downloader);
+    void rebalance();
+    QNetworkAccessManager* managerForNextConnection(const QString& host, int limit);
+
+    QScopedPointer<QNetworkAccessManager> manager;
+    QList<QNetworkAccessManager*> extraManagers;
+    QList<Entry> queued; // Sorted by priority
+    QList<Entry> running; // Sorted by priority
+
+    void _q_finished();
+    void _q_destroyed(QObject* object);
+};
+
+#endif // FASTDOWNLOADQUEUE_P_H
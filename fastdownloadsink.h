@@ -0,0 +1,55 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADSINK_H
+#define FASTDOWNLOADSINK_H
+
+#include "fastdownloader_global.h"
+
+#include <QtGlobal>
+
+/*!
+    Some notes:
+    A sink takes the data of a download as it arrives, in place of the "readyRead" signal and the
+    read functions of FastDownloader (set it with FastDownloader::setSink). The "consume" function
+    is called right from the handler of the reply delivering the data, in the thread of the
+    downloader, with the offset of the data within the content. The data is read into a buffer
+    the downloader reuses (taken from a pool shared by all the downloads in the process), so it
+    is only valid during the call, copy what you need to keep. Return false if the data cannot be
+    taken (i.e. a write error), the download fails with UnknownContentError then.
+
+    The data of each connection comes in order, but the connections are delivered interleaved,
+    just like the "readyRead" signal. A connection that fails is retried from where its delivered
+    data ends, so no offset is delivered twice, unless the download starts over (the resource has
+    changed while resuming; offset 0 comes again then). A sink cannot be used along with an output
+    file or FastDownloadDevice, and the downloader doesn't take the ownership of it.
+*/
+
+class FASTDOWNLOADER_EXPORT FastDownloadSink
+{
+public:
+    virtual ~FastDownloadSink() = default;
+
+    virtual bool consume(qint64 offset, const char* data, qint64 size) = 0;
+};
+
+#endif // FASTDOWNLOADSINK_H
@@ -0,0 +1,535 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#include "fastdownloadworker_p.h"
+#include "fastdownloader.h"
+#include <QNetworkAccessManager>
+#include <QSet>
+
+#include <cstring>
+#include <limits>
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+static const QNetworkRequest::Attribute HTTP2_WAS_USED_ATTRIBUTE = QNetworkRequest::Http2WasUsedAttribute;
+#else
+static const QNetworkRequest::Attribute HTTP2_WAS_USED_ATTRIBUTE = QNetworkRequest::HTTP2WasUsedAttribute;
+#endif
+
+// Passed over to the stand-ins, the rest is of no use to FastDownloader
+static const QNetworkRequest::Attribute FORWARDED_ATTRIBUTES[] = {
+    QNetworkRequest::HttpStatusCodeAttribute,
+    QNetworkRequest::HttpReasonPhraseAttribute,
+    QNetworkRequest::RedirectionTargetAttribute,
+    QNetworkRequest::ConnectionEncryptedAttribute,
+    HTTP2_WAS_USED_ATTRIBUTE
+};
+
+FastDownloadWorker::FastDownloadWorker(const QNetworkProxy& proxy)
+    : m_proxy(proxy)
+    , m_load(0)
+{
+}
+
+FastDownloadWorker::~FastDownloadWorker()
+{
+    // The thread is over by now, the stand-ins must not call in anymore
+    for (Transfer* transfer : m_transfers) {
+        transfer->reply->disconnect(this);
+        QMutexLocker locker(&transfer->channel->mutex);
+        transfer->channel->worker = nullptr;
+    }
+    qDeleteAll(m_transfers);
+
+    QMutexLocker locker(&m_mutex);
+    for (const QSharedPointer<FastDownloadChannel>& channel : m_incoming) {
+        QMutexLocker channelLocker(&channel->mutex);
+        channel->worker = nullptr;
+    }
+}
+
+QNetworkReply* FastDownloadWorker::get(const QNetworkRequest& request)
+{
+    QSharedPointer<FastDownloadChannel> channel(new FastDownloadChannel);
+    channel->request = request;
+    channel->worker = this;
+
+    auto reply = new FastDownloadWorkerReply(channel);
+
+    QMutexLocker locker(&m_mutex);
+    m_incoming.append(channel);
+    ++m_load;
+    QMetaObject::invokeMethod(this, "process", Qt::QueuedConnection);
+    return reply;
+}
+
+int FastDownloadWorker::load() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_load;
+}
+
+void FastDownloadWorker::process()
+{
+    QList<QSharedPointer<FastDownloadChannel>> incoming;
+    {
+        QMutexLocker locker(&m_mutex);
+        incoming.swap(m_incoming);
+    }
+
+    for (const QSharedPointer<FastDownloadChannel>& channel : incoming)
+        start(channel);
+
+    // See what the stand-ins have asked for in the meantime
+    const QList<Transfer*> transfers(m_transfers);
+    for (Transfer* transfer : transfers) {
+        if (!m_transfers.contains(transfer))
+            continue;
+
+        bool aborted;
+        qint64 readBufferSize;
+        {
+            QMutexLocker locker(&transfer->channel->mutex);
+            aborted = transfer->channel->aborted;
+            readBufferSize = transfer->channel->readBufferSize;
+        }
+
+        if (aborted) {
+            transfer->reply->abort();
+            continue;
+        }
+
+        if (transfer->reply->readBufferSize() != readBufferSize)
+            transfer->reply->setReadBufferSize(readBufferSize);
+        pull(transfer);
+    }
+}
+
+void FastDownloadWorker::_q_metaDataChanged()
+{
+    Transfer* transfer = transferFor(sender());
+    QMutexLocker locker(&transfer->channel->mutex);
+    captureMetaData(transfer);
+    notify(transfer->channel.data());
+}
+
+void FastDownloadWorker::_q_readyRead()
+{
+    pull(transferFor(sender()));
+}
+
+void FastDownloadWorker::_q_redirected(const QUrl& url)
+{
+    Transfer* transfer = transferFor(sender());
+    QMutexLocker locker(&transfer->channel->mutex);
+    transfer->channel->redirects.append(url);
+    notify(transfer->channel.data());
+}
+
+void FastDownloadWorker::_q_sslErrors(const QList<QSslError>& errors)
+{
+    Transfer* transfer = transferFor(sender());
+
+    // The handshake goes on as soon as we return, so only what is
+    // ignored beforehand through the stand-in can be ignored here
+    bool ignoreAll;
+    QList<QSslError> expected;
+    {
+        QMutexLocker locker(&transfer->channel->mutex);
+        transfer->channel->sslErrors.append(errors);
+        ignoreAll = transfer->channel->ignoreAllSslErrors;
+        expected = transfer->channel->expectedSslErrors;
+        notify(transfer->channel.data());
+    }
+
+    if (ignoreAll)
+        transfer->reply->ignoreSslErrors();
+    else if (!expected.isEmpty())
+        transfer->reply->ignoreSslErrors(expected);
+}
+
+void FastDownloadWorker::_q_downloadProgress(qint64 bytesReceived, qint64 bytesTotal)
+{
+    Transfer* transfer = transferFor(sender());
+    QMutexLocker locker(&transfer->channel->mutex);
+    transfer->channel->progressChanged = true;
+    transfer->channel->bytesReceived = bytesReceived;
+    transfer->channel->bytesTotal = bytesTotal;
+    notify(transfer->channel.data());
+}
+
+void FastDownloadWorker::_q_finished()
+{
+    Transfer* transfer = transferFor(sender());
+    FastDownloadChannel* channel = transfer->channel.data();
+
+    {
+        // The reply is going away, whatever it still holds goes over regardless of the room left
+        QMutexLocker locker(&channel->mutex);
+        const QByteArray& data = transfer->reply->readAll();
+        if (!data.isEmpty()) {
+            channel->data.append(data);
+            channel->buffered += data.size();
+        }
+        if (!transfer->metaDataSent)
+            captureMetaData(transfer);
+        channel->finished = true;
+        channel->error = transfer->reply->error();
+        channel->errorString = transfer->reply->errorString();
+        channel->worker = nullptr;
+        notify(channel);
+    }
+
+    m_transfers.removeOne(transfer);
+    transfer->reply->disconnect(this);
+    transfer->reply->deleteLater();
+    delete transfer;
+
+    QMutexLocker locker(&m_mutex);
+    --m_load;
+}
+
+FastDownloadWorker::Transfer* FastDownloadWorker::transferFor(const QObject* sender) const
+{
+    for (Transfer* transfer : m_transfers) {
+        if (transfer->reply == sender)
+            return transfer;
+    }
+
+    Q_ASSERT(0);
+    return nullptr;
+}
+
+QNetworkAccessManager* FastDownloadWorker::managerForNextTransfer()
+{
+    // Same as FastDownloader does, a manager runs up to 6 requests per host in parallel,
+    // or more of them as streams, once one of its requests has turned out to use HTTP/2
+    QHash<QNetworkAccessManager*, int> load;
+    QSet<QNetworkAccessManager*> http2Managers;
+    for (Transfer* transfer : m_transfers) {
+        ++load[transfer->reply->manager()];
+        if (transfer->reply->attribute(HTTP2_WAS_USED_ATTRIBUTE).toBool())
+            http2Managers.insert(transfer->reply->manager());
+    }
+
+    for (QNetworkAccessManager* candidate : m_managers) {
+        const int limit = http2Managers.contains(candidate)
+                ? FastDownloader::MAX_HTTP2_STREAMS_PER_MANAGER
+                : FastDownloader::MAX_CONNECTIONS_PER_MANAGER;
+        if (load.value(candidate) < limit)
+            return candidate;
+    }
+
+    auto manager = new QNetworkAccessManager(this);
+    manager->setProxy(m_proxy);
+    m_managers.append(manager);
+    return manager;
+}
+
+void FastDownloadWorker::start(const QSharedPointer<FastDownloadChannel>& channel)
+{
+    {
+        QMutexLocker locker(&channel->mutex);
+        if (channel->aborted) {
+            channel->worker = nullptr;
+            QMutexLocker loadLocker(&m_mutex);
+            --m_load;
+            return;
+        }
+    }
+
+    auto transfer = new Transfer;
+    transfer->channel = channel;
+    transfer->reply = managerForNextTransfer()->get(channel->request);
+    m_transfers.append(transfer);
+
+    {
+        QMutexLocker locker(&channel->mutex);
+        transfer->reply->setReadBufferSize(channel->readBufferSize);
+    }
+
+    connect(transfer->reply, SIGNAL(metaDataChanged()), this, SLOT(_q_metaDataChanged()));
+    connect(transfer->reply, SIGNAL(readyRead()), this, SLOT(_q_readyRead()));
+    connect(transfer->reply, SIGNAL(redirected(QUrl)), this, SLOT(_q_redirected(QUrl)));
+    connect(transfer->reply, SIGNAL(sslErrors(const QList<QSslError>&)),
+            this, SLOT(_q_sslErrors(const QList<QSslError>&)));
+    connect(transfer->reply, SIGNAL(downloadProgress(qint64,qint64)),
+            this, SLOT(_q_downloadProgress(qint64,qint64)));
+    connect(transfer->reply, SIGNAL(finished()), this, SLOT(_q_finished()));
+}
+
+void FastDownloadWorker::pull(Transfer* transfer)
+{
+    FastDownloadChannel* channel = transfer->channel.data();
+    QMutexLocker locker(&channel->mutex);
+
+    const qint64 available = transfer->reply->bytesAvailable();
+    if (available <= 0)
+        return;
+
+    // Once the stand-in's buffer is full, the reply's fills up and TCP slows the server down
+    const qint64 room = channel->readBufferSize > 0
+            ? channel->readBufferSize - channel->buffered
+            : std::numeric_limits<qint64>::max();
+    channel->stalled = room < available;
+    if (room <= 0)
+        return;
+
+    const QByteArray& data = transfer->reply->read(qMin(room, available));
+    channel->data.append(data);
+    channel->buffered += data.size();
+    notify(channel);
+}
+
+void FastDownloadWorker::captureMetaData(Transfer* transfer)
+{
+    FastDownloadChannel* channel = transfer->channel.data();
+    channel->metaDataChanged = true;
+    channel->url = transfer->reply->url();
+    channel->rawHeaders = transfer->reply->rawHeaderPairs();
+    channel->attributes.clear();
+    for (QNetworkRequest::Attribute attribute : FORWARDED_ATTRIBUTES) {
+        const QVariant& value = transfer->reply->attribute(attribute);
+        if (value.isValid())
+            channel->attributes.insert(attribute, value);
+    }
+    transfer->metaDataSent = true;
+}
+
+void FastDownloadWorker::notify(FastDownloadChannel* channel)
+{
+    // Called with the channel locked, so the stand-in cannot be deleted meanwhile
+    // (and events posted to it are discarded along with it if it is deleted later)
+    if (channel->reply && !channel->notifying) {
+        channel->notifying = true;
+        QMetaObject::invokeMethod(channel->reply, "deliver", Qt::QueuedConnection);
+    }
+}
+
+FastDownloadWorkerReply::FastDownloadWorkerReply(const QSharedPointer<FastDownloadChannel>& channel)
+    : m_channel(channel)
+{
+    setRequest(channel->request);
+    setUrl(channel->request.url());
+    setOperation(QNetworkAccessManager::GetOperation);
+    open(QIODevice::ReadOnly);
+
+    QMutexLocker locker(&m_channel->mutex);
+    m_channel->reply = this;
+}
+
+FastDownloadWorkerReply::~FastDownloadWorkerReply()
+{
+    QMutexLocker locker(&m_channel->mutex);
+    m_channel->reply = nullptr;
+    if (!m_channel->finished) {
+        m_channel->aborted = true;
+        wakeWorker();
+    }
+}
+
+void FastDownloadWorkerReply::abort()
+{
+    if (isFinished())
+        return;
+
+    {
+        QMutexLocker locker(&m_channel->mutex);
+        m_channel->aborted = true;
+        m_channel->data.clear();
+        m_channel->dataOffset = 0;
+        m_channel->buffered = 0;
+        wakeWorker();
+    }
+
+    setError(OperationCanceledError, QStringLiteral("Operation canceled"));
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    emit errorOccurred(OperationCanceledError);
+#else
+    emit error(OperationCanceledError);
+#endif
+    setFinished(true);
+    emit finished();
+}
+
+void FastDownloadWorkerReply::close()
+{
+    abort();
+    QNetworkReply::close();
+}
+
+bool FastDownloadWorkerReply::isSequential() const
+{
+    return true;
+}
+
+qint64 FastDownloadWorkerReply::bytesAvailable() const
+{
+    QMutexLocker locker(&m_channel->mutex);
+    return QNetworkReply::bytesAvailable() + m_channel->buffered;
+}
+
+bool FastDownloadWorkerReply::canReadLine() const
+{
+    if (QNetworkReply::canReadLine())
+        return true;
+
+    QMutexLocker locker(&m_channel->mutex);
+    for (int i = 0; i < m_channel->data.size(); ++i) {
+        if (m_channel->data.at(i).indexOf('\n', i == 0 ? m_channel->dataOffset : 0) >= 0)
+            return true;
+    }
+    return false;
+}
+
+void FastDownloadWorkerReply::setReadBufferSize(qint64 size)
+{
+    QNetworkReply::setReadBufferSize(size);
+
+    QMutexLocker locker(&m_channel->mutex);
+    m_channel->readBufferSize = size;
+    wakeWorker();
+}
+
+void FastDownloadWorkerReply::ignoreSslErrors()
+{
+    QMutexLocker locker(&m_channel->mutex);
+    m_channel->ignoreAllSslErrors = true;
+}
+
+void FastDownloadWorkerReply::deliver()
+{
+    QList<QUrl> redirects;
+    bool metaDataChanged;
+    QUrl url;
+    QList<RawHeaderPair> rawHeaders;
+    QHash<int, QVariant> attributes;
+    QList<QSslError> sslErrors;
+    bool hasData;
+    bool progressChanged;
+    qint64 bytesReceived;
+    qint64 bytesTotal;
+    bool transferFinished;
+    NetworkError code;
+    QString errorString;
+    {
+        QMutexLocker locker(&m_channel->mutex);
+        m_channel->notifying = false;
+        redirects.swap(m_channel->redirects);
+        metaDataChanged = m_channel->metaDataChanged;
+        m_channel->metaDataChanged = false;
+        url = m_channel->url;
+        rawHeaders = m_channel->rawHeaders;
+        attributes = m_channel->attributes;
+        sslErrors.swap(m_channel->sslErrors);
+        hasData = m_channel->buffered > 0;
+        progressChanged = m_channel->progressChanged;
+        m_channel->progressChanged = false;
+        bytesReceived = m_channel->bytesReceived;
+        bytesTotal = m_channel->bytesTotal;
+        transferFinished = m_channel->finished;
+        code = m_channel->error;
+        errorString = m_channel->errorString;
+    }
+
+    // Emitted in the order the reply has, checking for an abort after each
+    for (const QUrl& target : redirects) {
+        if (isFinished())
+            return;
+        emit redirected(target);
+    }
+
+    if (isFinished())
+        return;
+
+    if (metaDataChanged) {
+        setUrl(url);
+        for (const RawHeaderPair& header : rawHeaders)
+            setRawHeader(header.first, header.second);
+        for (auto it = attributes.constBegin(); it != attributes.constEnd(); ++it)
+            setAttribute(QNetworkRequest::Attribute(it.key()), it.value());
+        emit this->metaDataChanged();
+    }
+
+    if (!sslErrors.isEmpty() && !isFinished())
+        emit this->sslErrors(sslErrors);
+
+    if (hasData && !isFinished())
+        emit readyRead();
+
+    if (progressChanged && !isFinished())
+        emit downloadProgress(bytesReceived, bytesTotal);
+
+    if (transferFinished && !isFinished()) {
+        if (code != NoError) {
+            setError(code, errorString);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+            emit errorOccurred(code);
+#else
+            emit error(code);
+#endif
+        }
+        setFinished(true);
+        emit finished();
+    }
+}
+
+qint64 FastDownloadWorkerReply::readData(char* data, qint64 maxSize)
+{
+    QMutexLocker locker(&m_channel->mutex);
+
+    qint64 length = 0;
+    while (length < maxSize && !m_channel->data.isEmpty()) {
+        const QByteArray& chunk = m_channel->data.first();
+        const qint64 size = qMin(maxSize - length, qint64(chunk.size() - m_channel->dataOffset));
+        std::memcpy(data + length, chunk.constData() + m_channel->dataOffset, size_t(size));
+        length += size;
+        m_channel->dataOffset += int(size);
+        if (m_channel->dataOffset == chunk.size()) {
+            m_channel->data.removeFirst();
+            m_channel->dataOffset = 0;
+        }
+    }
+    m_channel->buffered -= length;
+
+    // The worker stops reading once the buffer is full, there is room now
+    if (m_channel->stalled && length > 0) {
+        m_channel->stalled = false;
+        wakeWorker();
+    }
+
+    return length;
+}
+
+void FastDownloadWorkerReply::ignoreSslErrorsImplementation(const QList<QSslError>& errors)
+{
+    QMutexLocker locker(&m_channel->mutex);
+    m_channel->expectedSslErrors = errors;
+}
+
+void FastDownloadWorkerReply::wakeWorker() const
+{
+    // Called with the channel locked, the worker clears its pointer under the same lock
+    if (m_channel->worker)
+        QMetaObject::invokeMethod(m_channel->worker, "process", Qt::QueuedConnection);
+}
+
+#include "moc_fastdownloadworker_p.cpp"
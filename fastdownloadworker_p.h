@@ -0,0 +1,151 @@
+/****************************************************************************
+**
+** Copyright (C) 2019 Ömer Göktaş
+** Contact: omergoktas.com
+**
+** This file is part of the FastDownloader library.
+**
+** The FastDownloader is free software: you can redistribute it and/or
+** modify it under the terms of the GNU Lesser General Public License
+** version 3 as published by the Free Software Foundation.
+**
+** The FastDownloader is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public
+** License along with the FastDownloader. If not, see
+** <https://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+#ifndef FASTDOWNLOADWORKER_P_H
+#define FASTDOWNLOADWORKER_P_H
+
+#include <QNetworkReply>
+#include <QNetworkProxy>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QHash>
+
+class QNetworkAccessManager;
+class FastDownloadWorker;
+class FastDownloadWorkerReply;
+
+// Shared by a reply running in a worker thread and its stand-in, guarded by the mutex
+struct FastDownloadChannel
+{
+    QMutex mutex;
+    QNetworkRequest request;
+    FastDownloadWorker* worker = nullptr; // Null once the worker is done with it
+    FastDownloadWorkerReply* reply = nullptr; // Null once the stand-in is gone
+    bool notifying = false; // A delivery is already on its way to the stand-in
+    bool stalled = false; // The worker waits for some room in the buffer
+
+    // Set by the stand-in
+    bool aborted = false;
+    qint64 readBufferSize = 0;
+    bool ignoreAllSslErrors = false;
+    QList<QSslError> expectedSslErrors;
+
+    // Set by the worker
+    QList<QByteArray> data;
+    int dataOffset = 0; // Into the first one, the rest of it is not read yet
+    qint64 buffered = 0;
+    QList<QUrl> redirects;
+    bool metaDataChanged = false;
+    QUrl url;
+    QList<QNetworkReply::RawHeaderPair> rawHeaders;
+    QHash<int, QVariant> attributes;
+    QList<QSslError> sslErrors;
+    bool progressChanged = false;
+    qint64 bytesReceived = 0;
+    qint64 bytesTotal = -1;
+    bool finished = false;
+    QNetworkReply::NetworkError error = QNetworkReply::NoError;
+    QString errorString;
+};
+
+// Lives in a thread of its own, runs the requests handed over by FastDownloader
+class FastDownloadWorker : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(FastDownloadWorker)
+
+    struct Transfer
+    {
+        QSharedPointer<FastDownloadChannel> channel;
+        QNetworkReply* reply = nullptr;
+        bool metaDataSent = false;
+    };
+
+public:
+    explicit FastDownloadWorker(const QNetworkProxy& proxy);
+    ~FastDownloadWorker() override;
+
+    // Thread-safe, the stand-in returned lives in the calling thread
+    QNetworkReply* get(const QNetworkRequest& request);
+    int load() const;
+
+public slots:
+    void process();
+
+private slots:
+    void _q_metaDataChanged();
+    void _q_readyRead();
+    void _q_redirected(const QUrl& url);
+    void _q_sslErrors(const QList<QSslError>& errors);
+    void _q_downloadProgress(qint64 bytesReceived, qint64 bytesTotal);
+    void _q_finished();
+
+private:
+    Transfer* transferFor(const QObject* sender) const;
+    QNetworkAccessManager* managerForNextTransfer();
+    void start(const QSharedPointer<FastDownloadChannel>& channel);
+    void pull(Transfer* transfer);
+    static void captureMetaData(Transfer* transfer);
+    static void notify(FastDownloadChannel* channel);
+
+private:
+    const QNetworkProxy m_proxy;
+    QList<QNetworkAccessManager*> m_managers;
+    QList<Transfer*> m_transfers;
+    mutable QMutex m_mutex; // Guards the incoming requests and the load
+    QList<QSharedPointer<FastDownloadChannel>> m_incoming;
+    int m_load;
+};
+
+// Stands in for a reply running in a worker thread, lives in the thread it is created in
+class FastDownloadWorkerReply : public QNetworkReply
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(FastDownloadWorkerReply)
+
+public:
+    explicit FastDownloadWorkerReply(const QSharedPointer<FastDownloadChannel>& channel);
+    ~FastDownloadWorkerReply() override;
+
+    void abort() override;
+    void close() override;
+    bool isSequential() const override;
+    qint64 bytesAvailable() const override;
+    bool canReadLine() const override;
+    void setReadBufferSize(qint64 size) override;
+    void ignoreSslErrors() override;
+
+public slots:
+    void deliver();
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    void ignoreSslErrorsImplementation(const QList<QSslError>& errors) override;
+
+private:
+    void wakeWorker() const;
+
+private:
+    const QSharedPointer<FastDownloadChannel> m_channel;
+};
+
+#endif // FASTDOWNLOADWORKER_P_H